@@ -14,6 +14,7 @@ enum json_value_type
 
 struct json_object;
 struct json_string;
+struct json_state;
 struct json_array;
 struct json_number;
 
@@ -38,15 +39,28 @@ struct json_object_member
 
 struct json_object : json_value
 {
-    json_object_member* first = 0;
+    json_object_member* first = 0; // Members are stored contiguously, 'next' links are kept for convenience.
     size_t nmembers = 0;
 
+    // Objects with at least JSON_OBJECT_HASH_THRESHOLD members get hash indices over member names on first key lookup.
+    json_state* state = 0;
+    mutable unsigned int* key_index = 0;
+    mutable unsigned int* key_index_case_insensitive = 0;
+
+    inline json_object_member* member(size_t index) const { return index < nmembers ? &first[index] : 0; }
+
     /**
-    * Searches for object member with specified key name.
+    * Searches for object member with specified key name, ignoring case.
     * Returns null if no key with such name exists.
     */
     json_object_member* find_key(const char* name) const;
 
+    /**
+    * Searches for object member with specified key name.
+    * Returns first member in object order if there are several matching keys, or null if no key with such name exists.
+    */
+    json_object_member* find_key(const char* name, size_t name_count, bool case_sensitive) const;
+
     /**
     * Searches for object member with specified key name and specified element value type.
     * Returns null if no key with such name exists of value type doesn't match.
@@ -66,13 +80,17 @@ struct json_array_member
 
 struct json_array : json_value
 {
-    json_array_member* first = 0;
+    json_array_member* first = 0; // Members are stored contiguously, 'next' links are kept for convenience.
     size_t nmembers = 0;
+
+    inline json_array_member* member(size_t index) const { return index < nmembers ? &first[index] : 0; }
 };
 
 struct json_number : json_value
 {
     double number = 0;
+    long long integer = 0;   // Exact value of number without fraction and exponent that fits into 64 bits.
+    bool is_integer = false;
 };
 
 struct json_string : json_value
@@ -83,6 +101,13 @@ struct json_string : json_value
     bool equals(const char* string, size_t count, bool case_insensitive) const;
 };
 
+struct json_arena_block
+{
+    json_arena_block* next;
+    size_t size;
+    size_t used;
+};
+
 struct json_state
 {
     const char* src = NULL;
@@ -92,13 +117,58 @@ struct json_state
     json_object* root = NULL;
     bool valid = false;
     const char* error_message = NULL;
+
+    // All values of document are allocated from arena blocks and freed at once by json_free().
+    json_arena_block* arena = NULL;
+
+    // Members of objects and arrays that are being parsed, moved to arena when object or array ends.
+    json_object_member* pending_members = NULL;
+    size_t pending_members_count = 0;
+    size_t pending_members_capacity = 0;
+
+    size_t allocations_count = 0;  // Number of times json.h called malloc() or realloc() for document.
 };
 
 
 bool json_parse(json_state* state, const char* src, size_t count);
-void json_free(json_state* state);
+void json_free(json_state* state);  // Call it even if json_parse() failed, memory for parsed values is still owned by state.
 void json_dump(json_state* state);
 
+/**
+* Reads JSON number from characters in range [now, end) to 'number' without using C runtime locale.
+* Returns pointer to the first character after number or null if there is no valid number. Like RFC 8259 requires,
+* plus sign is not allowed and number with leading zero ends after it.
+*/
+const char* json_scan_number(const char* now, const char* end, json_number* number);
+
+/**
+* Decodes escape sequences of JSON string text in range [chars, chars + count) (without quotes) to UTF-8, UTF-16
+* surrogate pairs are combined and unpaired surrogates become U+FFFD. Decoded text is never longer than source,
+* so 'out' needs space for 'count' characters, it can also point to 'chars' to decode in place.
+* Returns length of decoded text.
+*/
+size_t json_decode_string(const char* chars, size_t count, char* out);
+
+/**
+* Cursor API: navigates JSON text in place without building values and without allocating memory.
+* Values that are not needed are skipped by matching quotes and brackets. Cursor uses 'src', 'now', 'end',
+* 'valid' and 'error_message' of json_state, json_free() doesn't need to be called.
+*
+* All functions return false on error and set state->valid to false. json_cursor_next_member() and
+* json_cursor_next_element() also return false after last member, check state->valid to tell these apart.
+*
+* Names and strings are slices of source text. When 'escaped' is set to true, slice contains escape sequences
+* and can be decoded by json_decode_string().
+*/
+void json_cursor_begin(json_state* state, const char* src, size_t count);
+bool json_cursor_enter_object(json_state* state);
+bool json_cursor_next_member(json_state* state, const char** name, size_t* name_count, bool* escaped = NULL);
+bool json_cursor_enter_array(json_state* state);
+bool json_cursor_next_element(json_state* state);
+bool json_cursor_skip_value(json_state* state);
+bool json_cursor_read_string(json_state* state, const char** chars, size_t* count, bool* escaped = NULL);
+bool json_cursor_read_number(json_state* state, json_number* number);
+
 
 #ifdef JSON_IMPLEMENTATION
 
@@ -106,13 +176,262 @@ void json_dump(json_state* state);
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <locale.h>
+#include <new>
+
+#define JSON_ARENA_MIN_BLOCK_SIZE 4096
+#define JSON_OBJECT_HASH_THRESHOLD 16
+
+// Define JSON_NO_SIMD to classify text without SSE2/AVX2 instructions (useful to compare speed).
+#if !defined(JSON_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define JSON_SIMD
+#include <emmintrin.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 
-static const char* json_parse_string(json_state* state, size_t* out_count);
+static const char* json_parse_string(json_state* state, size_t* out_count, bool* out_escaped = NULL);
+static const char* json_parse_decoded_string(json_state* state, size_t* out_count);
 static json_value* json_parse_value(json_state* state);
 static json_object* json_parse_object(json_state* state);
 
 
+static void* json_alloc(json_state* state, size_t size)
+{
+    assert(state);
+
+    size = (size + 7) & ~(size_t)7;
+
+    json_arena_block* block = state->arena;
+    if (!block || block->used + size > block->size)
+    {
+        // First block is sized after source text, every next one is twice as big as previous.
+        size_t block_size = block ? block->size * 2 : (size_t)(state->end - state->src);
+        if (block_size < JSON_ARENA_MIN_BLOCK_SIZE)  block_size = JSON_ARENA_MIN_BLOCK_SIZE;
+        if (block_size < size)  block_size = size;
+
+        block = (json_arena_block*)malloc(sizeof(json_arena_block) + block_size);
+        if (!block)
+            return 0;
+        ++state->allocations_count;
+        block->next = state->arena;
+        block->size = block_size;
+        block->used = 0;
+        state->arena = block;
+    }
+
+    void* result = (char*)(block + 1) + block->used;
+    block->used += size;
+    return result;
+}
+
+template <typename T>
+static T* json_new(json_state* state)
+{
+    void* memory = json_alloc(state, sizeof(T));
+    if (!memory)
+    {
+        state->valid = false;
+        state->error_message = "Out of memory.";
+        return 0;
+    }
+    return new (memory) T();
+}
+
+static bool json_push_pending_member(json_state* state, const char* name, size_t name_count, json_value* value)
+{
+    if (state->pending_members_count == state->pending_members_capacity)
+    {
+        size_t capacity = state->pending_members_capacity ? state->pending_members_capacity * 2 : 64;
+        auto members = (json_object_member*)realloc(state->pending_members, capacity * sizeof(json_object_member));
+        if (!members)
+        {
+            state->valid = false;
+            state->error_message = "Out of memory.";
+            return false;
+        }
+        ++state->allocations_count;
+        state->pending_members = members;
+        state->pending_members_capacity = capacity;
+    }
+
+    json_object_member* member = &state->pending_members[state->pending_members_count++];
+    member->name = name;
+    member->name_count = name_count;
+    member->value = value;
+    member->next = 0;
+    return true;
+}
+
+
+// Structural scanning: text is classified a chunk of 16 (SSE2) or 32 (AVX2) characters at a time into bitmasks,
+// bit N is set when character N belongs to class, so position of the first interesting character is the number of
+// trailing zero bits.
+#ifdef JSON_SIMD
+
+#ifdef __AVX2__
+typedef __m256i json_chunk;
+#define JSON_CHUNK_SIZE 32
+static inline json_chunk json_chunk_load(const char* p)            { return _mm256_loadu_si256((const __m256i*)p); }
+static inline json_chunk json_chunk_splat(char c)                  { return _mm256_set1_epi8(c); }
+static inline json_chunk json_chunk_equals(json_chunk chunk, char c) { return _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(c)); }
+static inline json_chunk json_chunk_or(json_chunk a, json_chunk b)  { return _mm256_or_si256(a, b); }
+static inline json_chunk json_chunk_at_most(json_chunk chunk, char c) { return _mm256_cmpeq_epi8(_mm256_min_epu8(chunk, _mm256_set1_epi8(c)), chunk); }
+static inline unsigned long long json_chunk_mask(json_chunk chunk)  { return (unsigned int)_mm256_movemask_epi8(chunk); }
+#else
+typedef __m128i json_chunk;
+#define JSON_CHUNK_SIZE 16
+static inline json_chunk json_chunk_load(const char* p)            { return _mm_loadu_si128((const __m128i*)p); }
+static inline json_chunk json_chunk_splat(char c)                  { return _mm_set1_epi8(c); }
+static inline json_chunk json_chunk_equals(json_chunk chunk, char c) { return _mm_cmpeq_epi8(chunk, _mm_set1_epi8(c)); }
+static inline json_chunk json_chunk_or(json_chunk a, json_chunk b)  { return _mm_or_si128(a, b); }
+static inline json_chunk json_chunk_at_most(json_chunk chunk, char c) { return _mm_cmpeq_epi8(_mm_min_epu8(chunk, _mm_set1_epi8(c)), chunk); }
+static inline unsigned long long json_chunk_mask(json_chunk chunk)  { return (unsigned int)_mm_movemask_epi8(chunk); }
+#endif
+
+static inline json_chunk json_classify_whitespace(json_chunk chunk)
+{
+    return json_chunk_or(json_chunk_or(json_chunk_equals(chunk, ' '), json_chunk_equals(chunk, '\t')),
+                         json_chunk_or(json_chunk_equals(chunk, '\n'), json_chunk_equals(chunk, '\r')));
+}
+
+static inline json_chunk json_classify_string(json_chunk chunk)
+{
+    return json_chunk_or(json_chunk_equals(chunk, '"'), json_chunk_equals(chunk, '\\'));
+}
+
+// Quotes, backslashes and control characters, which must be escaped in strings.
+static inline json_chunk json_classify_string_special(json_chunk chunk)
+{
+    return json_chunk_or(json_classify_string(chunk), json_chunk_at_most(chunk, 0x1F));
+}
+
+static inline json_chunk json_classify_container(json_chunk chunk)
+{
+    // '[' and ']' differ from '{' and '}' only by 0x20 bit.
+    json_chunk folded = json_chunk_or(chunk, json_chunk_splat(0x20));
+    return json_chunk_or(json_classify_string(chunk), json_chunk_or(json_chunk_equals(folded, '{'), json_chunk_equals(folded, '}')));
+}
+
+#endif
+
+static inline int json_count_trailing_zeros(unsigned long long mask)
+{
+    assert(mask);
+#if defined(_MSC_VER) && defined(_M_X64)
+    unsigned long index;
+    _BitScanForward64(&index, mask);
+    return (int)index;
+#elif defined(_MSC_VER)
+    unsigned long index;
+    if (_BitScanForward(&index, (unsigned long)mask))
+        return (int)index;
+    _BitScanForward(&index, (unsigned long)(mask >> 32));
+    return 32 + (int)index;
+#else
+    return __builtin_ctzll(mask);
+#endif
+}
+
+static inline bool json_is_whitespace(char c)
+{
+    return c == ' ' || c == '\x09' || c == '\x0A' || c == '\x0D';
+}
+
+static inline bool json_is_escape_char(char c)
+{
+    return c == '"' || c == '\\' || c == '/' || c == 'b' || c == 'f' || c == 'r' || c == 't' || c == 'n' || c == 'u';
+}
+
+// Reads 4 hex digits of \u escape sequence, returns -1 if they are invalid.
+static inline int json_read_hex4(const char* chars)
+{
+    int value = 0;
+    for (int i = 0; i < 4; ++i)
+    {
+        char c = chars[i];
+        int digit;
+        if (c >= '0' && c <= '9')       digit = c - '0';
+        else if (c >= 'a' && c <= 'f')  digit = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')  digit = c - 'A' + 10;
+        else                            return -1;
+        value = value * 16 + digit;
+    }
+    return value;
+}
+
+// Returns first non-whitespace character in range or 'end'.
+static inline const char* json_find_non_whitespace(const char* now, const char* end)
+{
+    // Usually there is no whitespace or just a single space.
+    if (now < end && !json_is_whitespace(*now))
+        return now;
+    if (now + 1 < end && !json_is_whitespace(now[1]))
+        return now + 1;
+
+#ifdef JSON_SIMD
+    for (; now + JSON_CHUNK_SIZE <= end; now += JSON_CHUNK_SIZE)
+    {
+        unsigned long long mask = ~json_chunk_mask(json_classify_whitespace(json_chunk_load(now))) & ((1ULL << JSON_CHUNK_SIZE) - 1);
+        if (mask)
+            return now + json_count_trailing_zeros(mask);
+    }
+#endif
+    while (now < end && json_is_whitespace(*now))
+        ++now;
+    return now;
+}
+
+// Returns first '"', '\\' or control character in range or 'end'.
+static inline const char* json_find_string_special(const char* now, const char* end)
+{
+#ifdef JSON_SIMD
+    for (; now + JSON_CHUNK_SIZE <= end; now += JSON_CHUNK_SIZE)
+    {
+        unsigned long long mask = json_chunk_mask(json_classify_string_special(json_chunk_load(now)));
+        if (mask)
+            return now + json_count_trailing_zeros(mask);
+    }
+#endif
+    while (now < end && *now != '"' && *now != '\\' && (unsigned char)*now >= 0x20)
+        ++now;
+    return now;
+}
+
+// Returns mask of quotes, backslashes and brackets in characters starting from 'now' and number of classified
+// characters in 'count': 64 when whole block is classified at once, otherwise mask only has the first of them.
+static inline unsigned long long json_container_mask(const char* now, const char* end, int* count)
+{
+#ifdef JSON_SIMD
+    if (end - now >= 64)
+    {
+        unsigned long long mask = 0;
+        for (int i = 0; i < 64; i += JSON_CHUNK_SIZE)
+            mask |= json_chunk_mask(json_classify_container(json_chunk_load(now + i))) << i;
+        *count = 64;
+        return mask;
+    }
+#endif
+    int limit = end - now < 64 ? (int)(end - now) : 64;
+    for (int i = 0; i < limit; ++i)
+    {
+        char c = now[i];
+        if (c == '"' || c == '\\' || c == '{' || c == '}' || c == '[' || c == ']')
+        {
+            *count = i + 1;
+            return 1ULL << i;
+        }
+    }
+    *count = limit;
+    return 0;
+}
+
 static const char* json_skip(json_state* state, const char* now = NULL) {
     assert(state);
 
@@ -122,19 +441,155 @@ static const char* json_skip(json_state* state, const char* now = NULL) {
     if (now >= state->end)
         return 0;
 
-    for (; now < state->end; ++now)
-    {
-        char c = *now;
-        if (c == ' ' || c == '\x09' || c == '\x0A' || c == '\x0D')
-            continue;
-        else
-            break;
-    }
+    now = json_find_non_whitespace(now, state->end);
 
     state->now = now;
     return now < state->end ? now : 0;
 }
 
+// Slow path of json_scan_number() for numbers that can't be converted exactly with one multiplication or division.
+static double json_strtod(const char* chars, size_t count)
+{
+    char buffer[128];
+    char* copy = count < sizeof(buffer) ? buffer : (char*)malloc(count + 1);
+    if (!copy)
+        return 0;
+    memcpy(copy, chars, count);
+    copy[count] = '\0';
+
+    // Decimal separator of current locale may be not a dot.
+#ifdef _MSC_VER
+    static _locale_t c_locale = _create_locale(LC_NUMERIC, "C");
+    double result = _strtod_l(copy, NULL, c_locale);
+#else
+    static locale_t c_locale = newlocale(LC_NUMERIC_MASK, "C", (locale_t)0);
+    double result = strtod_l(copy, NULL, c_locale);
+#endif
+
+    if (copy != buffer)
+        free(copy);
+    return result;
+}
+
+const char* json_scan_number(const char* now, const char* end, json_number* number)
+{
+    assert(now);
+    assert(end);
+    assert(number);
+
+    static const double powers_of_ten[] = {
+        1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+
+    const char* start = now;
+    bool negative = false;
+    if (now < end && now[0] == '-')
+    {
+        negative = true;
+        ++now;
+    }
+    if (now >= end || now[0] < '0' || now[0] > '9')
+        return 0;
+
+    // Keep up to 19 significant digits, so mantissa never overflows.
+    unsigned long long mantissa = 0;
+    int significant_digits = 0;
+    int exponent = 0;
+    bool truncated = false;
+    bool is_integer = true;
+
+    if (now[0] == '0')
+    {
+        ++now;
+    }
+    else
+    {
+        for (; now < end && now[0] >= '0' && now[0] <= '9'; ++now)
+        {
+            if (significant_digits < 19)
+            {
+                mantissa = mantissa * 10 + (now[0] - '0');
+                ++significant_digits;
+            }
+            else
+            {
+                ++exponent;
+                truncated = true;
+            }
+        }
+    }
+
+    if (now < end && now[0] == '.')
+    {
+        is_integer = false;
+        ++now;
+        if (now >= end || now[0] < '0' || now[0] > '9')
+            return 0;
+
+        for (; now < end && now[0] >= '0' && now[0] <= '9'; ++now)
+        {
+            if (significant_digits < 19)
+            {
+                mantissa = mantissa * 10 + (now[0] - '0');
+                if (mantissa != 0)  ++significant_digits;  // Leading zeros are not significant.
+                --exponent;
+            }
+            else
+            {
+                truncated = true;
+            }
+        }
+    }
+
+    if (now < end && (now[0] == 'e' || now[0] == 'E'))
+    {
+        is_integer = false;
+        ++now;
+
+        bool exponent_negative = false;
+        if (now < end && (now[0] == '-' || now[0] == '+'))
+        {
+            exponent_negative = now[0] == '-';
+            ++now;
+        }
+        if (now >= end || now[0] < '0' || now[0] > '9')
+            return 0;
+
+        int explicit_exponent = 0;
+        for (; now < end && now[0] >= '0' && now[0] <= '9'; ++now)
+        {
+            if (explicit_exponent < 100000)
+                explicit_exponent = explicit_exponent * 10 + (now[0] - '0');
+        }
+        exponent += exponent_negative ? -explicit_exponent : explicit_exponent;
+    }
+
+    number->is_integer = false;
+    number->integer = 0;
+
+    if (is_integer && !truncated && mantissa <= 9223372036854775807ULL + (negative ? 1 : 0))
+    {
+        // Integer fast path, exact for all 64-bit values.
+        number->is_integer = true;
+        number->integer = negative ? (long long)(0 - mantissa) : (long long)mantissa;
+        number->number = negative ? -(double)mantissa : (double)mantissa;
+    }
+    else if (!truncated && mantissa <= (1ULL << 53) && exponent >= -22 && exponent <= 22)
+    {
+        // Both mantissa and power of ten are exact doubles, so one operation gives correctly rounded result.
+        double value = (double)mantissa;
+        value = exponent < 0 ? value / powers_of_ten[-exponent] : value * powers_of_ten[exponent];
+        number->number = negative ? -value : value;
+    }
+    else
+    {
+        number->number = json_strtod(start, now - start);
+    }
+
+    return now;
+}
+
 static json_number* json_parse_number(json_state* state) {
     assert(state);
 
@@ -145,18 +600,18 @@ static json_number* json_parse_number(json_state* state) {
         return 0;
     }
 
-    int nreaded;
-    double dval;
-    if ((1 != _snscanf_s(now, state->end - now, "%lf%n", &dval, &nreaded)) || (nreaded <= 0)) {
+    json_number* number = json_new<json_number>(state);
+    if (!number)
+        return 0;
+    number->type = json_type_number;
+
+    now = json_scan_number(now, state->end, number);
+    if (!now) {
         state->valid = false;
         state->error_message = "Invalid number.";
         return 0;
     }
-    state->now = now + nreaded;
-
-    json_number* number = new json_number();
-    number->type = json_type_number;
-    number->number = dval;
+    state->now = now;
     return number;
 }
 
@@ -172,8 +627,7 @@ static json_array* json_parse_array(json_state* state)
     }
     now = state->now = now + 1;
 
-    json_array_member* first = 0;
-    json_array_member* last = 0;
+    size_t first_pending = state->pending_members_count;
     size_t nitems = 0;
     while (1)
     {
@@ -187,21 +641,12 @@ static json_array* json_parse_array(json_state* state)
 
         json_value* value = json_parse_value(state);
         if (!value)
-            return 0; // @Leak: first, last
+            return 0;
 
-        json_array_member* item = new json_array_member();
-        item->value = value;
-        item->next = 0;
+        if (!json_push_pending_member(state, 0, 0, value))
+            return 0;
         ++nitems;
 
-        if (!first) first = item;
-        if (!last)  last  = item;
-        else
-        {
-            last->next = item;
-            last = item;
-        }
-
         now = json_skip(state);
         if (!now) {
             state->valid = false;
@@ -223,10 +668,30 @@ static json_array* json_parse_array(json_state* state)
     return NULL;
 
 array_end:
-    json_array* array = new json_array();
+    json_array* array = json_new<json_array>(state);
+    if (!array)
+        return 0;
     array->type = json_type_array;
     array->nmembers = nitems;
-    array->first = first;
+
+    if (nitems)
+    {
+        array->first = (json_array_member*)json_alloc(state, nitems * sizeof(json_array_member));
+        if (!array->first)
+        {
+            state->valid = false;
+            state->error_message = "Out of memory.";
+            return 0;
+        }
+
+        json_object_member* pending = &state->pending_members[first_pending];
+        for (size_t i = 0; i < nitems; ++i)
+        {
+            array->first[i].value = pending[i].value;
+            array->first[i].next = i + 1 < nitems ? &array->first[i + 1] : 0;
+        }
+    }
+    state->pending_members_count = first_pending;
 
     state->now = now + 1; // Don't forget closing ']' bracket.
     return array;
@@ -246,14 +711,16 @@ static json_value* json_parse_value(json_state* state)
     if (now[0] == '"')
     {
         size_t count;
-        const char* chars = json_parse_string(state, &count);
+        const char* chars = json_parse_decoded_string(state, &count);
         if (!chars) {
             state->valid = false;
             state->error_message = "Expected string.";
             return 0;
         }
 
-        json_string* s = new json_string();
+        json_string* s = json_new<json_string>(state);
+        if (!s)
+            return 0;
         s->type = json_type_string;
         s->chars = chars;
         s->count = count;
@@ -268,27 +735,33 @@ static json_value* json_parse_value(json_state* state)
     {
         return json_parse_array(state);
     }
-    else if ((now[0] >= '0' && now[0] <= '9') || now[0] == '-' || now[0] == '+')
+    else if ((now[0] >= '0' && now[0] <= '9') || now[0] == '-')
     {
         return json_parse_number(state);
     }
     else if (now + 4 < state->end && now[0] == 'n' && now[1] == 'u' && now[2] == 'l' && now[3] == 'l')
     {
-        json_value* value = new json_value();
+        json_value* value = json_new<json_value>(state);
+        if (!value)
+            return 0;
         value->type = json_type_null;
         state->now += 4;
         return value;
     }
     else if (now + 4 < state->end && now[0] == 't' && now[1] == 'r' && now[2] == 'u' && now[3] == 'e')
     {
-        json_value* value = new json_value();
+        json_value* value = json_new<json_value>(state);
+        if (!value)
+            return 0;
         value->type = json_type_true;
         state->now += 4;
         return value;
     }
     else if (now + 5 < state->end && now[0] == 'f' && now[1] == 'a' && now[2] == 'l' && now[3] == 's' && now[4] == 'e')
     {
-        json_value* value = new json_value();
+        json_value* value = json_new<json_value>(state);
+        if (!value)
+            return 0;
         value->type = json_type_false;
         state->now += 5;
         return value;
@@ -322,8 +795,7 @@ static json_object* json_parse_object(json_state* state)
     }
     now = state->now = now + 1;
 
-    json_object_member* first = 0;
-    json_object_member* last  = 0;
+    size_t first_pending = state->pending_members_count;
     size_t nitems = 0;
     while (1)
     {
@@ -336,7 +808,7 @@ static json_object* json_parse_object(json_state* state)
         }
 
         size_t key_count;
-        auto key = json_parse_string(state, &key_count);
+        auto key = json_parse_decoded_string(state, &key_count);
         if (!key)
             goto error;
 
@@ -349,21 +821,10 @@ static json_object* json_parse_object(json_state* state)
         if (!value)
             goto error;
 
-        json_object_member* item = new json_object_member();
-        item->name = key;
-        item->name_count = key_count;
-        item->value = value;
-        item->next = 0;
+        if (!json_push_pending_member(state, key, key_count, value))
+            return 0;
         ++nitems;
 
-        if (!first) first = item;
-        if (!last)  last  = item;
-        else 
-        {
-            last->next = item;
-            last = item;
-        }
-
         // Handle comma and closing bracket.
         now = json_skip(state);
         if (!now)
@@ -381,34 +842,45 @@ static json_object* json_parse_object(json_state* state)
     }
 
 error:
-    if (first)  // @TODO: Check same thing for parse_array
-    {
-        json_object_member* next = first->next;
-        delete first;
-        first = next;
-    }
-
     state->valid = false;
     state->error_message = "Invalid object.";
     return 0;
 
 object_end:
-    json_object* o = new json_object();
+    json_object* o = json_new<json_object>(state);
+    if (!o)
+        return 0;
     o->type = json_type_object;
-    o->first = first;
     o->nmembers = nitems;
+    o->state = state;
+
+    if (nitems)
+    {
+        o->first = (json_object_member*)json_alloc(state, nitems * sizeof(json_object_member));
+        if (!o->first)
+        {
+            state->valid = false;
+            state->error_message = "Out of memory.";
+            return 0;
+        }
+
+        memcpy(o->first, &state->pending_members[first_pending], nitems * sizeof(json_object_member));
+        for (size_t i = 0; i < nitems; ++i)
+            o->first[i].next = i + 1 < nitems ? &o->first[i + 1] : 0;
+    }
+    state->pending_members_count = first_pending;
 
     state->now = now + 1; // Don't forget closing '}' bracket.
     return o;
 }
 
-static const char* json_parse_string(json_state* state, size_t* out_count)
+static const char* json_parse_string(json_state* state, size_t* out_count, bool* out_escaped)
 {
     assert(state);
     assert(out_count);
 
     const char* now = json_skip(state);
-    if (now >= state->end)
+    if (!now)
     {
         state->valid = false;
         state->error_message = "Expected string.";
@@ -424,11 +896,21 @@ static const char* json_parse_string(json_state* state, size_t* out_count)
 
     const char* chars = ++now;
     size_t count = 0;
+    bool escaped = false;
 
     while (now < state->end)
     {
-        // @TODO: handle escape sequences.
+        now = json_find_string_special(now, state->end);
+        if (now >= state->end)
+            break;
+
         char c = *now++;
+        if ((unsigned char)c < 0x20)
+        {
+            state->valid = false;
+            state->error_message = "Unescaped control character in string.";
+            return 0;
+        }
         if (c == '\\')
         {
             if (now >= state->end)
@@ -437,6 +919,7 @@ static const char* json_parse_string(json_state* state, size_t* out_count)
                 state->error_message = "Invalid escape sequence.";
                 return 0;
             }
+            escaped = true;
             char n = *now++;
             switch (n)
             {
@@ -452,7 +935,10 @@ static const char* json_parse_string(json_state* state, size_t* out_count)
                 case 'u':
                 {
                     // https://tools.ietf.org/html/rfc7159#section-2
-                    // @TODO: Handle UTF16
+                    // Surrogates are paired when string is decoded.
+                    if (state->end - now < 4 || json_read_hex4(now) < 0)
+                        break;
+                    now += 4;
                     continue;
                 }
             }
@@ -477,9 +963,125 @@ static const char* json_parse_string(json_state* state, size_t* out_count)
 ok:
     state->now = now;
     *out_count = count;
+    if (out_escaped)  *out_escaped = escaped;
     return chars;
 }
 
+// Strings without escape sequences stay slices of source text, others are decoded to arena.
+static const char* json_parse_decoded_string(json_state* state, size_t* out_count)
+{
+    bool escaped;
+    const char* chars = json_parse_string(state, out_count, &escaped);
+    if (!chars || !escaped)
+        return chars;
+
+    char* decoded = (char*)json_alloc(state, *out_count);
+    if (!decoded)
+    {
+        state->valid = false;
+        state->error_message = "Out of memory.";
+        return 0;
+    }
+    *out_count = json_decode_string(chars, *out_count, decoded);
+    return decoded;
+}
+
+static char* json_encode_utf8(char* out, unsigned int codepoint)
+{
+    if (codepoint < 0x80)
+    {
+        *out++ = (char)codepoint;
+    }
+    else if (codepoint < 0x800)
+    {
+        *out++ = (char)(0xC0 | (codepoint >> 6));
+        *out++ = (char)(0x80 | (codepoint & 0x3F));
+    }
+    else if (codepoint < 0x10000)
+    {
+        *out++ = (char)(0xE0 | (codepoint >> 12));
+        *out++ = (char)(0x80 | ((codepoint >> 6) & 0x3F));
+        *out++ = (char)(0x80 | (codepoint & 0x3F));
+    }
+    else
+    {
+        *out++ = (char)(0xF0 | (codepoint >> 18));
+        *out++ = (char)(0x80 | ((codepoint >> 12) & 0x3F));
+        *out++ = (char)(0x80 | ((codepoint >> 6) & 0x3F));
+        *out++ = (char)(0x80 | (codepoint & 0x3F));
+    }
+    return out;
+}
+
+size_t json_decode_string(const char* chars, size_t count, char* out)
+{
+    assert(chars || !count);
+    assert(out || !count);
+
+    const char* now = chars;
+    const char* end = chars + count;
+    char* out_now = out;
+
+    while (now < end)
+    {
+        // Copy text up to next escape sequence at once.
+        const char* escape = json_find_string_special(now, end);
+        memmove(out_now, now, escape - now);
+        out_now += escape - now;
+        now = escape;
+
+        if (now >= end)
+            break;
+        if (*now != '\\' || now + 1 >= end)
+        {
+            *out_now++ = *now++;
+            continue;
+        }
+
+        char c = now[1];
+        now += 2;
+        switch (c)
+        {
+            case 'b': *out_now++ = '\b'; break;
+            case 'f': *out_now++ = '\f'; break;
+            case 'r': *out_now++ = '\r'; break;
+            case 't': *out_now++ = '\t'; break;
+            case 'n': *out_now++ = '\n'; break;
+            case 'u':
+            {
+                int codepoint = end - now >= 4 ? json_read_hex4(now) : -1;
+                if (codepoint < 0)
+                {
+                    *out_now++ = '?';  // Not validated by parser, U+FFFD wouldn't fit in place of "\u".
+                    break;
+                }
+                now += 4;
+
+                // Characters outside of BMP are written as high and low surrogates.
+                if (codepoint >= 0xD800 && codepoint <= 0xDBFF && end - now >= 6 && now[0] == '\\' && now[1] == 'u')
+                {
+                    int low = json_read_hex4(now + 2);
+                    if (low >= 0xDC00 && low <= 0xDFFF)
+                    {
+                        codepoint = 0x10000 + ((codepoint - 0xD800) << 10) + (low - 0xDC00);
+                        now += 6;
+                    }
+                }
+                if (codepoint >= 0xD800 && codepoint <= 0xDFFF)
+                    codepoint = 0xFFFD;
+
+                out_now = json_encode_utf8(out_now, (unsigned int)codepoint);
+                break;
+            }
+            default:
+                *out_now++ = c;  // '"', '\\' and '/'.
+                break;
+        }
+    }
+
+    return out_now - out;
+}
+
 
 bool json_parse(json_state* state, const char* src, size_t count)
 {
@@ -490,64 +1092,282 @@ bool json_parse(json_state* state, const char* src, size_t count)
     state->now = src;
     state->end = src + count;
     state->valid = true;
+    state->pending_members_count = 0;
     state->root = json_parse_object(state);
 
+    // Only whitespace may follow root object.
+    if (state->root && json_skip(state))
+    {
+        state->valid = false;
+        state->error_message = "Unexpected text after root object.";
+    }
+
+    // Pending members are needed only during parsing.
+    free(state->pending_members);
+    state->pending_members = NULL;
+    state->pending_members_capacity = 0;
+    state->pending_members_count = 0;
+
     return state->valid;
 }
 
-static void json_free_value(json_value* value)
+static bool json_cursor_error(json_state* state, const char* error_message)
 {
-    switch (value->type)
+    state->valid = false;
+    state->error_message = error_message;
+    return false;
+}
+
+// Cursor keeps no stack of containers, so first member is told apart by the bracket that was just entered before it.
+static bool json_cursor_at_first_item(json_state* state, char bracket)
+{
+    return state->now > state->src && state->now[-1] == bracket;
+}
+
+void json_cursor_begin(json_state* state, const char* src, size_t count)
+{
+    assert(state);
+    assert(src);
+
+    state->src = src;
+    state->now = src;
+    state->end = src + count;
+    state->valid = true;
+    state->error_message = NULL;
+}
+
+bool json_cursor_enter_object(json_state* state)
+{
+    assert(state);
+
+    const char* now = json_skip(state);
+    if (!now || now[0] != '{')
+        return json_cursor_error(state, "Expected object.");
+
+    state->now = now + 1;
+    return true;
+}
+
+bool json_cursor_next_member(json_state* state, const char** name, size_t* name_count, bool* escaped)
+{
+    assert(state);
+    assert(name);
+    assert(name_count);
+
+    if (!state->valid)
+        return false;
+
+    bool first = json_cursor_at_first_item(state, '{');
+    const char* now = json_skip(state);
+    if (!now)
+        return json_cursor_error(state, "Invalid object.");
+
+    if (now[0] == '}')
     {
-        case json_type_true:
-        case json_type_false:
-        case json_type_null:
-        case json_type_number:
-        case json_type_string:
-            break;
-        case json_type_object:
+        state->now = now + 1;
+        return false;
+    }
+
+    // Exactly one comma between members, like json_parse() expects.
+    if (first == (now[0] == ','))
+        return json_cursor_error(state, "Invalid object.");
+    if (!first)
+        state->now = now + 1;
+
+    *name = json_parse_string(state, name_count, escaped);
+    if (!*name)
+        return false;
+
+    now = json_skip(state);
+    if (!now || now[0] != ':')
+        return json_cursor_error(state, "Invalid object.");
+
+    state->now = now + 1;
+    return true;
+}
+
+bool json_cursor_enter_array(json_state* state)
+{
+    assert(state);
+
+    const char* now = json_skip(state);
+    if (!now || now[0] != '[')
+        return json_cursor_error(state, "Expected array.");
+
+    state->now = now + 1;
+    return true;
+}
+
+bool json_cursor_next_element(json_state* state)
+{
+    assert(state);
+
+    if (!state->valid)
+        return false;
+
+    bool first = json_cursor_at_first_item(state, '[');
+    const char* now = json_skip(state);
+    if (!now)
+        return json_cursor_error(state, "Invalid array.");
+
+    if (now[0] == ']')
+    {
+        state->now = now + 1;
+        return false;
+    }
+
+    if (first == (now[0] == ','))
+        return json_cursor_error(state, "Invalid array.");
+    if (!first)
+        state->now = now + 1;
+
+    return true;
+}
+
+bool json_cursor_skip_value(json_state* state)
+{
+    assert(state);
+
+    const char* now = json_skip(state);
+    if (!now)
+        return json_cursor_error(state, "Expected value.");
+
+    switch (now[0])
+    {
+        case '"':
         {
-            auto object = (json_object*)value;
-            auto now = object->first;
-            while (now)
-            {
-                if (now->value)
-                    json_free_value(now->value);
-                auto next = now->next;
-                delete now;
-                now = next;
-            }
-            break;
+            size_t count;
+            return json_parse_string(state, &count) != 0;
         }
-        case json_type_array:
+        case '{':
+        case '[':
         {
-            auto array = (json_array*)value;
-            auto now = array->first;
-            while (now)
+            // Only brackets outside of strings matter, their kinds are not checked against each other.
+            // Text is classified in blocks of 64 characters, every quote, backslash and bracket in block is visited
+            // through bitmask without looking at other characters.
+            const char* end = state->end;
+            int depth = 0;
+            bool in_string = false;
+            while (now < end)
             {
-                if (now->value)
-                    json_free_value(now->value);
-                auto next = now->next;
-                delete now;
-                now = next;
+                const char* block = now;
+                int block_count;
+                unsigned long long mask = json_container_mask(block, end, &block_count);
+                now = block + block_count;
+
+                while (mask)
+                {
+                    const char* at = block + json_count_trailing_zeros(mask);
+                    mask &= mask - 1;
+
+                    char c = *at;
+                    if (in_string)
+                    {
+                        if (c == '"')
+                        {
+                            in_string = false;
+                        }
+                        else if (c == '\\')
+                        {
+                            if (at + 1 >= end || !json_is_escape_char(at[1]))
+                                return json_cursor_error(state, "Invalid escape sequence.");
+
+                            // Escaped character may be a quote or backslash, so classify text after it again.
+                            now = at + 2;
+                            break;
+                        }
+                    }
+                    else if (c == '"')
+                    {
+                        in_string = true;
+                    }
+                    else if (c == '{' || c == '[')
+                    {
+                        ++depth;
+                    }
+                    else if (c == '}' || c == ']')
+                    {
+                        if (--depth == 0)
+                        {
+                            state->now = at + 1;
+                            return true;
+                        }
+                    }
+                    else
+                    {
+                        return json_cursor_error(state, "Unexpected backslash.");
+                    }
+                }
             }
-            break;
+            return json_cursor_error(state, "Unterminated object or array.");
+        }
+        case 't':
+        case 'n':
+        {
+            if (state->end - now < 4 || (memcmp(now, "true", 4) != 0 && memcmp(now, "null", 4) != 0))
+                return json_cursor_error(state, "Invalid value.");
+            state->now = now + 4;
+            return true;
+        }
+        case 'f':
+        {
+            if (state->end - now < 5 || memcmp(now, "false", 5) != 0)
+                return json_cursor_error(state, "Invalid value.");
+            state->now = now + 5;
+            return true;
         }
         default:
-            return;
+        {
+            json_number number;
+            return json_cursor_read_number(state, &number);
+        }
     }
+}
+
+bool json_cursor_read_string(json_state* state, const char** chars, size_t* count, bool* escaped)
+{
+    assert(state);
+    assert(chars);
+    assert(count);
 
-    delete value;
+    *chars = json_parse_string(state, count, escaped);
+    return *chars != 0;
 }
 
+bool json_cursor_read_number(json_state* state, json_number* number)
+{
+    assert(state);
+    assert(number);
+
+    const char* now = json_skip(state);
+    if (!now)
+        return json_cursor_error(state, "Expected number.");
+
+    now = json_scan_number(now, state->end, number);
+    if (!now)
+        return json_cursor_error(state, "Invalid number.");
+
+    number->type = json_type_number;
+    state->now = now;
+    return true;
+}
+
+// Frees all values of document at once, cost depends only on amount of arena blocks and not on amount of values.
 void json_free(json_state* state)
 {
     assert(state);
 
     state->valid = false;
-    if (state && state->root)
-        json_free_value(state->root);
     state->root = NULL;
+
+    json_arena_block* block = state->arena;
+    while (block)
+    {
+        json_arena_block* next = block->next;
+        free(block);
+        block = next;
+    }
+    state->arena = NULL;
 }
 
 void json_print_value(json_value* value)
@@ -635,16 +1455,92 @@ void json_dump(json_state* state)
     json_print_value(state->root);
 }
 
+static unsigned int json_hash_key(const char* name, size_t count, bool case_sensitive)
+{
+    // FNV-1a
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < count; ++i)
+    {
+        unsigned char c = (unsigned char)name[i];
+        if (!case_sensitive && c >= 'A' && c <= 'Z')
+            c += 'a' - 'A';
+        hash ^= c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static inline bool json_key_equals(const json_object_member* member, const char* name, size_t name_count, bool case_sensitive)
+{
+    if (member->name_count != name_count)
+        return false;
+    return case_sensitive ? strncmp(member->name, name, name_count) == 0 : _strnicmp(member->name, name, name_count) == 0;
+}
+
+static inline size_t json_key_index_size(size_t nmembers)
+{
+    size_t size = 1;
+    while (size < nmembers * 2)
+        size <<= 1;
+    return size;
+}
+
+// Open addressing table of member indices plus one, zero marks empty slot. Members are inserted in object order,
+// so probing finds first of several matching keys.
+static unsigned int* json_build_key_index(const json_object* object, bool case_sensitive)
+{
+    size_t size = json_key_index_size(object->nmembers);
+    unsigned int* index = (unsigned int*)json_alloc(object->state, size * sizeof(unsigned int));
+    if (!index)
+        return 0;
+    memset(index, 0, size * sizeof(unsigned int));
+
+    for (size_t i = 0; i < object->nmembers; ++i)
+    {
+        const json_object_member* member = &object->first[i];
+        size_t slot = json_hash_key(member->name, member->name_count, case_sensitive) & (size - 1);
+        while (index[slot])
+            slot = (slot + 1) & (size - 1);
+        index[slot] = (unsigned int)(i + 1);
+    }
+    return index;
+}
+
 json_object_member* json_object::find_key(const char* name) const
 {
     if (!name) return 0;
 
-    size_t name_count = strlen(name);
+    return find_key(name, strlen(name), false);
+}
+
+json_object_member* json_object::find_key(const char* name, size_t name_count, bool case_sensitive) const
+{
+    if (!name) return 0;
+
+    if (nmembers >= JSON_OBJECT_HASH_THRESHOLD && state)
+    {
+        unsigned int*& index = case_sensitive ? key_index : key_index_case_insensitive;
+        if (!index)
+            index = json_build_key_index(this, case_sensitive);
+
+        if (index)
+        {
+            size_t size = json_key_index_size(nmembers);
+            size_t slot = json_hash_key(name, name_count, case_sensitive) & (size - 1);
+            for (; index[slot]; slot = (slot + 1) & (size - 1))
+            {
+                json_object_member* member = &first[index[slot] - 1];
+                if (json_key_equals(member, name, name_count, case_sensitive))
+                    return member;
+            }
+            return 0;
+        }
+    }
 
     json_object_member* member = this->first;
     while (member)
     {
-        if (member->name_count == name_count && _strnicmp(member->name, name, name_count) == 0)
+        if (json_key_equals(member, name, name_count, case_sensitive))
             break;
         member = member->next;
     }
@@ -654,7 +1550,7 @@ json_object_member* json_object::find_key(const char* name) const
 json_object_member* json_object::find_key_with_value_type(const char* name, json_value_type value_type)
 {
     json_object_member* member = find_key(name);
-    return member->value->type == value_type ? member : 0;
+    return member && member->value->type == value_type ? member : 0;
 }
 
 json_string* json_object::get_string(const char* key_name)
@@ -0,0 +1,922 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <Windows.h>
+#include <assert.h>
+#include <ctype.h>
+#include <locale.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#define JSON_IMPLEMENTATION
+#include "json.h"
+
+// Benchmarks for json.h, run them in Release configuration. Paths to JSON files can be passed in command line.
+// Every parsed document is also checked against simple reference parser.
+
+enum { NUMBERS_COUNT = 1000000 };  // Amount of numbers in generated text for number parsing benchmark.
+enum { BENCHMARK_RUNS = 5 };       // Every benchmark is run this many times and best time is reported.
+enum { RANDOM_DOCUMENTS_COUNT = 1000 };  // Amount of random documents that are checked against reference parser.
+enum { MALFORMED_DOCUMENTS_COUNT = 1000 };  // Amount of mostly invalid documents that are checked against reference parser.
+
+#ifdef NDEBUG
+#define verify(expr)  do { if (!(expr)) { fprintf(stderr, "Assertion failed: %s\n", #expr); ExitProcess(1); } } while (0)
+#else
+#define verify assert
+#endif
+
+inline LARGE_INTEGER get_tick() {
+    LARGE_INTEGER tick;
+    QueryPerformanceCounter(&tick);
+    return tick;
+}
+
+inline double seconds_since(LARGE_INTEGER tick_start) {
+    LARGE_INTEGER clock_frequency;
+    QueryPerformanceFrequency(&clock_frequency);
+    return (get_tick().QuadPart - tick_start.QuadPart) / (double)clock_frequency.QuadPart;
+}
+
+// Deterministic random numbers, so every run parses the same text.
+unsigned int random_state = 12345;
+unsigned int random_next() {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+// Generates comma separated numbers that look like ones in Anki models JSON: mostly ords, sizes,
+// timestamps and 13-digit ids, with some decimals.
+char* generate_numbers_text(int count, int* text_size) {
+    int capacity = count * 32;
+    char* text = (char*)malloc(capacity);
+    verify(text);
+
+    int size = 0;
+    for (int i = 0; i < count; ++i) {
+        char* now = text + size;
+        int remaining = capacity - size;
+        switch (random_next() % 5) {
+            case 0:  size += snprintf(now, remaining, "%u,", random_next() % 16); break;
+            case 1:  size += snprintf(now, remaining, "%u,", random_next() % 100); break;
+            case 2:  size += snprintf(now, remaining, "%u,", 1500000000 + random_next() % 100000000); break;
+            case 3:  size += snprintf(now, remaining, "%llu,", 1342697561419ULL + random_next()); break;
+            default: size += snprintf(now, remaining, "%.3f,", (random_next() % 100000) / 7.0); break;
+        }
+    }
+
+    *text_size = size;
+    return text;
+}
+
+// Number parsing that json_parse_number() used before json_scan_number().
+double parse_numbers_scanf(const char* text, int text_size, int* count) {
+    const char* now = text;
+    const char* end = text + text_size;
+
+    double sum = 0;
+    *count = 0;
+    while (now < end) {
+        int nreaded;
+        double value;
+        verify(1 == _snscanf_s(now, end - now, "%lf%n", &value, &nreaded) && nreaded > 0);
+        sum += value;
+        ++*count;
+        now += nreaded + 1;  // Skip comma.
+    }
+    return sum;
+}
+
+double parse_numbers_json(const char* text, int text_size, int* count) {
+    const char* now = text;
+    const char* end = text + text_size;
+
+    double sum = 0;
+    *count = 0;
+    while (now < end) {
+        json_number number;
+        now = json_scan_number(now, end, &number);
+        verify(now);
+        sum += number.number;
+        ++*count;
+        now += 1;  // Skip comma.
+    }
+    return sum;
+}
+
+typedef double (*parse_numbers_proc)(const char* text, int text_size, int* count);
+
+void run_number_benchmark(const char* name, parse_numbers_proc parse_numbers, const char* text, int text_size) {
+    double best_time = 1e9;
+    double sum = 0;
+    int count = 0;
+    for (int run = 0; run < BENCHMARK_RUNS; ++run) {
+        LARGE_INTEGER tick_start = get_tick();
+        sum = parse_numbers(text, text_size, &count);
+        best_time = min(best_time, seconds_since(tick_start));
+    }
+
+    printf("  %-20s %8.2lf MB/s %8.2lf ns/number (%d numbers, sum %.17g)\n",
+        name, text_size / best_time / (1024 * 1024), best_time * 1e9 / count, count, sum);
+}
+
+// Checks that json_scan_number() gives same values as scanf and exact integers.
+void verify_numbers(const char* text, int text_size) {
+    const char* now = text;
+    const char* end = text + text_size;
+
+    int mismatches = 0;
+    while (now < end) {
+        int nreaded;
+        double expected;
+        verify(1 == _snscanf_s(now, end - now, "%lf%n", &expected, &nreaded) && nreaded > 0);
+
+        json_number number;
+        const char* number_end = json_scan_number(now, end, &number);
+        if (number_end != now + nreaded || number.number != expected)  ++mismatches;
+        if (number.is_integer && (double)number.integer != number.number)  ++mismatches;
+
+        now += nreaded + 1;
+    }
+    printf("  %d mismatches between scanf and json_scan_number()\n", mismatches);
+}
+
+void benchmark_numbers() {
+    int text_size = 0;
+    char* text = generate_numbers_text(NUMBERS_COUNT, &text_size);
+
+    printf("Number parsing:\n");
+    verify_numbers(text, text_size);
+    run_number_benchmark("scanf", parse_numbers_scanf, text, text_size);
+    run_number_benchmark("json_scan_number", parse_numbers_json, text, text_size);
+
+    free(text);
+}
+
+// Appends formatted text, 'text' must have enough capacity.
+void append_text(char* text, int* size, int capacity, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(text + *size, capacity - *size, format, args);
+    va_end(args);
+    verify(written >= 0 && written < capacity - *size);
+    *size += written;
+}
+
+// Generates text shaped like 'col.models' column of Anki collection: object of note types keyed by id, every
+// note type has fields, card templates, long CSS and LaTeX strings with escapes.
+char* generate_models_text(int models_count, int* text_size) {
+    int capacity = 1024 + models_count * 4096;
+    char* text = (char*)malloc(capacity);
+    verify(text);
+
+    int size = 0;
+    append_text(text, &size, capacity, "{");
+    for (int model = 0; model < models_count; ++model) {
+        unsigned long long id = 1342697561419ULL + model * 1000ULL + random_next() % 1000;
+        int fields_count = 2 + random_next() % 6;
+
+        append_text(text, &size, capacity,
+            "%s\"%llu\": {\"id\": %llu, \"name\": \"Note Type %d\", \"type\": 0, \"mod\": %u, \"usn\": -1, "
+            "\"sortf\": 0, \"did\": 1, \"tags\": [], \"vers\": [], \"latexPost\": \"\\\\end{document}\", "
+            "\"latexPre\": \"\\\\documentclass[12pt]{article}\\n\\\\special{papersize=3in,5in}\\n"
+            "\\\\usepackage[utf8]{inputenc}\\n\\\\usepackage{amssymb,amsmath}\\n\\\\pagestyle{empty}\\n"
+            "\\\\setlength{\\\\parindent}{0in}\\n\\\\begin{document}\\n\", "
+            "\"css\": \".card {\\n font-family: arial;\\n font-size: 20px;\\n text-align: center;\\n"
+            " color: black;\\n background-color: white;\\n}\\n\", \"flds\": [",
+            model ? ", " : "", id, id, model, 1500000000 + random_next() % 100000000);
+
+        for (int field = 0; field < fields_count; ++field) {
+            append_text(text, &size, capacity,
+                "%s{\"name\": \"Field %d\", \"ord\": %d, \"sticky\": false, \"rtl\": false, \"font\": \"Arial\", "
+                "\"size\": 20, \"media\": []}",
+                field ? ", " : "", field, field);
+        }
+
+        append_text(text, &size, capacity,
+            "], \"tmpls\": [{\"name\": \"Card 1\", \"ord\": 0, \"qfmt\": \"{{Field 0}}\", "
+            "\"afmt\": \"{{FrontSide}}\\n\\n<hr id=answer>\\n\\n{{Field 1}}\", \"did\": null, "
+            "\"bqfmt\": \"\", \"bafmt\": \"\"}], \"req\": [[0, \"all\", [0]]]}");
+    }
+    append_text(text, &size, capacity, "}");
+
+    *text_size = size;
+    return text;
+}
+
+// Pieces of strings in random documents: plain and multibyte text, every kind of escape sequence, surrogate
+// pairs and unpaired surrogates, and characters that are structural outside of strings.
+static const char* random_string_pieces[] = {
+    "a", "Front", " ", "食べる", "カメラ", "{", "}", "[", "]", ",", ":",
+    "\\\"", "\\\\", "\\/", "\\b", "\\f", "\\n", "\\r", "\\t",
+    "\\u0041", "\\u00e9", "\\u98df", "\\u0000", "\\ud83d\\ude00", "\\ud83d", "\\ude00", "\\uD83D\\uDE00",
+};
+
+// Numbers in random documents, including ones that need slow path of json_scan_number().
+static const char* random_numbers[] = {
+    "0", "-0", "7", "-15", "1342697561419", "9007199254740993", "18446744073709551616", "0.5", "-3.25",
+    "1e10", "1E-7", "2.5e+3", "0.1", "123456789012345678901234567890", "4.9406564584124654e-324",
+    "1.7976931348623157e308", "2.2250738585072011e-308", "3.14159265358979323846264338327950288",
+    "0e0", "-0.0E-0", "1E+2",
+};
+
+void generate_random_string(char* text, int* size, int capacity) {
+    append_text(text, size, capacity, "\"");
+    int pieces_count = random_next() % 4 == 0 ? random_next() % 200 : random_next() % 8;
+    for (int i = 0; i < pieces_count; ++i)
+        append_text(text, size, capacity, "%s", random_string_pieces[random_next() % ARRAYSIZE(random_string_pieces)]);
+    append_text(text, size, capacity, "\"");
+}
+
+void generate_random_value(char* text, int* size, int capacity, int depth) {
+    static const char* whitespace[] = { "", "", " ", "\n  ", "\t" };
+    append_text(text, size, capacity, "%s", whitespace[random_next() % ARRAYSIZE(whitespace)]);
+
+    unsigned int kind = depth > 5 ? random_next() % 5 : random_next() % 7;
+    switch (kind) {
+        case 0: append_text(text, size, capacity, "%s", random_next() % 2 ? "true" : "false"); break;
+        case 1: append_text(text, size, capacity, "null"); break;
+        case 2: append_text(text, size, capacity, "%s", random_numbers[random_next() % ARRAYSIZE(random_numbers)]); break;
+        case 3: append_text(text, size, capacity, "%d", (int)random_next()); break;
+        case 4: generate_random_string(text, size, capacity); break;
+        case 5: {
+            int count = random_next() % 6;
+            append_text(text, size, capacity, "[");
+            for (int i = 0; i < count; ++i) {
+                if (i)  append_text(text, size, capacity, ",");
+                generate_random_value(text, size, capacity, depth + 1);
+            }
+            append_text(text, size, capacity, "]");
+            break;
+        }
+        default: {
+            // Objects large enough to get hashed member names are generated too.
+            int count = random_next() % 8 == 0 ? 20 + random_next() % 20 : random_next() % 6;
+            append_text(text, size, capacity, "{");
+            for (int i = 0; i < count; ++i) {
+                if (i)  append_text(text, size, capacity, ",");
+                generate_random_string(text, size, capacity);
+                append_text(text, size, capacity, ": ");
+                generate_random_value(text, size, capacity, depth + 1);
+            }
+            append_text(text, size, capacity, "}");
+            break;
+        }
+    }
+}
+
+// Generates random valid document with object at root.
+char* generate_random_document(int* text_size) {
+    int capacity = 16 * 1024 * 1024;
+    char* text = (char*)malloc(capacity);
+    verify(text);
+
+    int size = 0;
+    append_text(text, &size, capacity, "{");
+    int count = random_next() % 20;
+    for (int i = 0; i < count; ++i) {
+        append_text(text, &size, capacity, "%s\"m%d\": ", i ? ", " : "", i);
+        generate_random_value(text, &size, capacity, 1);
+    }
+    append_text(text, &size, capacity, "}");
+
+    *text_size = size;
+    return text;
+}
+
+// Values that RFC 8259 doesn't allow: numbers with plus sign, leading zeros or missing digits, literals and escape
+// sequences with typos, unescaped control characters in strings and broken arrays and objects.
+static const char* malformed_values[] = {
+    "+1", "01", "-01", "00", "-", "--1", ".5", "-.5", "1.", "1.e5", "1e", "1e+", "0x10", "NaN", "Infinity", "-Infinity",
+    "tru", "nul", "fals", "True", "'a'", "\"\\x\"", "\"\\u12G4\"", "\"\\u00\"", "\"\\U0041\"", "\"a\tb\"", "\"a\nb\"",
+    "\"\x01\"", "\"unterminated", "[1,]", "[,1]", "[1 2]", "[1,,2]", "{\"a\": 1,}", "{,}", "{\"a\" 1}", "{\"a\":}",
+    "{a: 1}", "{1: 1}", "[", "{", "]", "}",
+};
+
+// Generates document that is usually invalid: random document that is truncated, has character deleted or
+// duplicated or has text after root object, or small document with malformed value in it. Some of them stay valid,
+// reference parser decides which ones are.
+char* generate_malformed_document(int* text_size) {
+    int capacity = 16 * 1024 * 1024;
+    char* text = generate_random_document(text_size);
+    int size = *text_size;
+
+    switch (random_next() % 5) {
+        case 0: size = random_next() % size; break;
+        case 1: {
+            int at = random_next() % size;
+            memmove(text + at, text + at + 1, size - at - 1);
+            --size;
+            break;
+        }
+        case 2: {
+            int at = random_next() % size;
+            memmove(text + at + 1, text + at, size - at);
+            ++size;
+            break;
+        }
+        case 3: {
+            static const char* trailing_texts[] = { " x", "}", ",", " {}", "\"" };
+            append_text(text, &size, capacity, "%s", trailing_texts[random_next() % ARRAYSIZE(trailing_texts)]);
+            break;
+        }
+        default: {
+            static const char* templates[] = { "{\"a\": %s}", "{\"a\": [0, %s]}", "{\"a\": {\"b\": %s}, \"c\": 1}" };
+            size = 0;
+            append_text(text, &size, capacity, templates[random_next() % ARRAYSIZE(templates)],
+                malformed_values[random_next() % ARRAYSIZE(malformed_values)]);
+            break;
+        }
+    }
+
+    *text_size = size;
+    return text;
+}
+
+char* read_file(const char* path, int* text_size) {
+    FILE* file = fopen(path, "rb");
+    if (!file)
+        return NULL;
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    char* text = (char*)malloc(size + 1);
+    verify(text);
+    verify(fread(text, 1, size, file) == (size_t)size);
+    fclose(file);
+
+    *text_size = (int)size;
+    return text;
+}
+
+// Reference parser: straightforward recursive descent parser that is written for clarity, every value is
+// allocated separately and strings are decoded one character at a time. It accepts exactly the grammar of RFC 8259.
+// Trees built by json_parse() and walked by cursor are checked against it, so json.h optimizations can't silently
+// change results or start accepting invalid documents.
+struct reference_value {
+    json_value_type type;
+    double number;
+    char* chars;                // Decoded string.
+    size_t count;
+    char* name;                 // Decoded name of object member.
+    size_t name_count;
+    reference_value* first;     // Elements of array or members of object.
+    reference_value* next;
+};
+
+struct reference_parser {
+    const char* now;
+    const char* end;
+};
+
+void reference_free(reference_value* value) {
+    while (value) {
+        reference_value* next = value->next;
+        reference_free(value->first);
+        free(value->chars);
+        free(value->name);
+        free(value);
+        value = next;
+    }
+}
+
+void reference_skip_whitespace(reference_parser* parser) {
+    while (parser->now < parser->end &&
+           (*parser->now == ' ' || *parser->now == '\t' || *parser->now == '\r' || *parser->now == '\n')) {
+        ++parser->now;
+    }
+}
+
+bool reference_parse_hex4(reference_parser* parser, unsigned int* value) {
+    if (parser->end - parser->now < 4)  return false;
+
+    *value = 0;
+    for (int i = 0; i < 4; ++i) {
+        char c = *parser->now++;
+        *value *= 16;
+        if (c >= '0' && c <= '9')       *value += c - '0';
+        else if (c >= 'a' && c <= 'f')  *value += c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')  *value += c - 'A' + 10;
+        else                            return false;
+    }
+    return true;
+}
+
+void reference_append_utf8(char* chars, size_t* count, unsigned int codepoint) {
+    if (codepoint < 0x80) {
+        chars[(*count)++] = (char)codepoint;
+    } else if (codepoint < 0x800) {
+        chars[(*count)++] = (char)(0xC0 | (codepoint >> 6));
+        chars[(*count)++] = (char)(0x80 | (codepoint & 0x3F));
+    } else if (codepoint < 0x10000) {
+        chars[(*count)++] = (char)(0xE0 | (codepoint >> 12));
+        chars[(*count)++] = (char)(0x80 | ((codepoint >> 6) & 0x3F));
+        chars[(*count)++] = (char)(0x80 | (codepoint & 0x3F));
+    } else {
+        chars[(*count)++] = (char)(0xF0 | (codepoint >> 18));
+        chars[(*count)++] = (char)(0x80 | ((codepoint >> 12) & 0x3F));
+        chars[(*count)++] = (char)(0x80 | ((codepoint >> 6) & 0x3F));
+        chars[(*count)++] = (char)(0x80 | (codepoint & 0x3F));
+    }
+}
+
+bool reference_parse_string(reference_parser* parser, char** chars, size_t* count) {
+    if (parser->now >= parser->end || *parser->now != '"')  return false;
+    ++parser->now;
+
+    // Decoded string is never longer than its source.
+    *chars = (char*)malloc(parser->end - parser->now + 1);
+    verify(*chars);
+    *count = 0;
+
+    while (parser->now < parser->end) {
+        char c = *parser->now++;
+        if (c == '"')  return true;
+        if ((unsigned char)c < 0x20)  return false;  // Control characters must be escaped.
+        if (c != '\\') {
+            (*chars)[(*count)++] = c;
+            continue;
+        }
+
+        if (parser->now >= parser->end)  return false;
+        c = *parser->now++;
+        switch (c) {
+            case '"':  (*chars)[(*count)++] = '"';  break;
+            case '\\': (*chars)[(*count)++] = '\\'; break;
+            case '/':  (*chars)[(*count)++] = '/';  break;
+            case 'b':  (*chars)[(*count)++] = '\b'; break;
+            case 'f':  (*chars)[(*count)++] = '\f'; break;
+            case 'n':  (*chars)[(*count)++] = '\n'; break;
+            case 'r':  (*chars)[(*count)++] = '\r'; break;
+            case 't':  (*chars)[(*count)++] = '\t'; break;
+            case 'u': {
+                unsigned int codepoint;
+                if (!reference_parse_hex4(parser, &codepoint))  return false;
+
+                if (codepoint >= 0xD800 && codepoint <= 0xDBFF) {
+                    const char* low_start = parser->now;
+                    unsigned int low;
+                    if (parser->end - parser->now >= 6 && parser->now[0] == '\\' && parser->now[1] == 'u') {
+                        parser->now += 2;
+                        if (reference_parse_hex4(parser, &low) && low >= 0xDC00 && low <= 0xDFFF) {
+                            codepoint = 0x10000 + (codepoint - 0xD800) * 0x400 + (low - 0xDC00);
+                        } else {
+                            parser->now = low_start;
+                        }
+                    }
+                }
+                if (codepoint >= 0xD800 && codepoint <= 0xDFFF)  codepoint = 0xFFFD;
+
+                reference_append_utf8(*chars, count, codepoint);
+                break;
+            }
+            default:
+                return false;
+        }
+    }
+    return false;
+}
+
+bool reference_parse_number(reference_parser* parser, double* number) {
+    const char* start = parser->now;
+    const char* now = start;
+    const char* end = parser->end;
+
+    // No plus sign and no leading zeros: "01" is "0" followed by text that isn't part of number.
+    if (now < end && *now == '-')  ++now;
+    if (now >= end || !isdigit((unsigned char)*now))  return false;
+    if (*now == '0') {
+        ++now;
+    } else {
+        while (now < end && isdigit((unsigned char)*now))  ++now;
+    }
+    if (now < end && *now == '.') {
+        ++now;
+        if (now >= end || !isdigit((unsigned char)*now))  return false;
+        while (now < end && isdigit((unsigned char)*now))  ++now;
+    }
+    if (now < end && (*now == 'e' || *now == 'E')) {
+        ++now;
+        if (now < end && (*now == '-' || *now == '+'))  ++now;
+        if (now >= end || !isdigit((unsigned char)*now))  return false;
+        while (now < end && isdigit((unsigned char)*now))  ++now;
+    }
+
+    char buffer[512];
+    size_t count = now - start;
+    verify(count < sizeof(buffer));
+    memcpy(buffer, start, count);
+    buffer[count] = '\0';
+
+    // strtod() uses decimal separator of current locale, reference must read numbers like JSON does.
+    static _locale_t c_locale = _create_locale(LC_NUMERIC, "C");
+    *number = _strtod_l(buffer, NULL, c_locale);
+    parser->now = now;
+    return true;
+}
+
+reference_value* reference_parse_value(reference_parser* parser) {
+    reference_skip_whitespace(parser);
+    if (parser->now >= parser->end)  return NULL;
+
+    reference_value* value = (reference_value*)calloc(1, sizeof(reference_value));
+    verify(value);
+
+    char c = *parser->now;
+    if (c == '{' || c == '[') {
+        bool is_object = c == '{';
+        value->type = is_object ? json_type_object : json_type_array;
+        ++parser->now;
+
+        reference_value** last = &value->first;
+        reference_skip_whitespace(parser);
+        if (parser->now < parser->end && *parser->now == (is_object ? '}' : ']')) {
+            ++parser->now;
+            return value;
+        }
+
+        while (true) {
+            char* name = NULL;
+            size_t name_count = 0;
+            if (is_object) {
+                reference_skip_whitespace(parser);
+                if (!reference_parse_string(parser, &name, &name_count))  goto error;
+                reference_skip_whitespace(parser);
+                if (parser->now >= parser->end || *parser->now != ':')  { free(name); goto error; }
+                ++parser->now;
+            }
+
+            reference_value* member = reference_parse_value(parser);
+            if (!member)  { free(name); goto error; }
+            member->name = name;
+            member->name_count = name_count;
+            *last = member;
+            last = &member->next;
+
+            reference_skip_whitespace(parser);
+            if (parser->now >= parser->end)  goto error;
+            c = *parser->now++;
+            if (c == (is_object ? '}' : ']'))  return value;
+            if (c != ',')  goto error;
+        }
+    } else if (c == '"') {
+        value->type = json_type_string;
+        if (!reference_parse_string(parser, &value->chars, &value->count))  goto error;
+    } else if (parser->end - parser->now >= 4 && 0 == memcmp(parser->now, "true", 4)) {
+        value->type = json_type_true;
+        parser->now += 4;
+    } else if (parser->end - parser->now >= 5 && 0 == memcmp(parser->now, "false", 5)) {
+        value->type = json_type_false;
+        parser->now += 5;
+    } else if (parser->end - parser->now >= 4 && 0 == memcmp(parser->now, "null", 4)) {
+        value->type = json_type_null;
+        parser->now += 4;
+    } else {
+        value->type = json_type_number;
+        if (!reference_parse_number(parser, &value->number))  goto error;
+    }
+    return value;
+
+error:
+    reference_free(value);
+    return NULL;
+}
+
+// Returns null if text isn't valid JSON document with object at root, which is what json_parse() expects.
+reference_value* reference_parse_document(const char* text, int text_size) {
+    reference_parser parser = { text, text + text_size };
+    reference_value* reference = reference_parse_value(&parser);
+    reference_skip_whitespace(&parser);
+    if (reference && (reference->type != json_type_object || parser.now != parser.end)) {
+        reference_free(reference);
+        reference = NULL;
+    }
+    return reference;
+}
+
+bool strings_equal(const char* a, size_t a_count, const char* b, size_t b_count) {
+    return a_count == b_count && 0 == memcmp(a, b, a_count);
+}
+
+// How json.h handled document compared to reference parser.
+enum document_check {
+    document_match,             // Both accepted document with the same values or both rejected it.
+    document_different_values,
+    document_wrongly_accepted,  // Reference parser rejected document.
+    document_wrongly_rejected,  // Reference parser accepted document.
+    document_checks_count,
+};
+
+static const char* document_check_names[document_checks_count] = {
+    "matches reference parser",
+    "DIFFERS FROM REFERENCE PARSER",
+    "ACCEPTS DOCUMENT REJECTED BY REFERENCE PARSER",
+    "REJECTS DOCUMENT ACCEPTED BY REFERENCE PARSER",
+};
+
+document_check get_document_check(bool accepted, bool same, reference_value* reference) {
+    if (accepted != (reference != NULL))
+        return accepted ? document_wrongly_accepted : document_wrongly_rejected;
+    return accepted && !same ? document_different_values : document_match;
+}
+
+// Returns true if values and all their children are the same.
+bool compare_with_reference(json_value* value, reference_value* reference) {
+    if (!value || !reference || value->type != reference->type)  return false;
+
+    switch (value->type) {
+        case json_type_number:
+            return ((json_number*)value)->number == reference->number;
+        case json_type_string: {
+            json_string* string = (json_string*)value;
+            return strings_equal(string->chars, string->count, reference->chars, reference->count);
+        }
+        case json_type_array: {
+            json_array* array = (json_array*)value;
+            reference_value* element = reference->first;
+            for (size_t i = 0; i < array->nmembers; ++i, element = element->next) {
+                if (!element || !compare_with_reference(array->member(i)->value, element))  return false;
+            }
+            return element == NULL;
+        }
+        case json_type_object: {
+            json_object* object = (json_object*)value;
+            reference_value* member = reference->first;
+            for (size_t i = 0; i < object->nmembers; ++i, member = member->next) {
+                json_object_member* object_member = object->member(i);
+                if (!member || !strings_equal(object_member->name, object_member->name_count, member->name, member->name_count))  return false;
+                if (!compare_with_reference(object_member->value, member))  return false;
+            }
+            return member == NULL;
+        }
+        default:
+            return true;
+    }
+}
+
+// Parses document with json_parse() and compares it with document parsed by reference parser, which is null if
+// document is invalid.
+document_check check_document_parse(const char* text, int text_size, reference_value* reference) {
+    json_state state;
+    bool accepted = json_parse(&state, text, text_size);
+    bool same = accepted && compare_with_reference(state.root, reference);
+    json_free(&state);
+    return get_document_check(accepted, same, reference);
+}
+
+// Returns first character of value at cursor or null at the end of text.
+const char* cursor_peek(json_state* state) {
+    const char* now = state->now;
+    while (now < state->end && (*now == ' ' || *now == '\t' || *now == '\r' || *now == '\n'))
+        ++now;
+    return now < state->end ? now : NULL;
+}
+
+bool cursor_string_equals(const char* chars, size_t count, bool escaped, const char* expected, size_t expected_count) {
+    if (!escaped)
+        return strings_equal(chars, count, expected, expected_count);
+
+    char* decoded = (char*)malloc(count + 1);
+    verify(decoded);
+    size_t decoded_count = json_decode_string(chars, count, decoded);
+    bool result = strings_equal(decoded, decoded_count, expected, expected_count);
+    free(decoded);
+    return result;
+}
+
+// Walks value at cursor entering every object and array and reading every string and number, so unlike
+// json_cursor_skip_value() all text is validated. Sets 'same' to false if value differs from 'reference',
+// which is null when there is nothing to compare with.
+void walk_cursor(json_state* state, reference_value* reference, bool* same) {
+    const char* now = cursor_peek(state);
+    if (!now) {
+        json_cursor_skip_value(state);  // Fails at the end of text.
+        return;
+    }
+
+    json_value_type type;
+    switch (*now) {
+        case '{': type = json_type_object; break;
+        case '[': type = json_type_array; break;
+        case '"': type = json_type_string; break;
+        case 't': type = json_type_true; break;
+        case 'f': type = json_type_false; break;
+        case 'n': type = json_type_null; break;
+        default:  type = json_type_number; break;
+    }
+    if (!reference || reference->type != type) {
+        *same = false;
+        reference = NULL;
+    }
+
+    switch (type) {
+        case json_type_object: {
+            reference_value* member = reference ? reference->first : NULL;
+            const char* name;
+            size_t name_count;
+            bool escaped;
+            json_cursor_enter_object(state);
+            while (json_cursor_next_member(state, &name, &name_count, &escaped)) {
+                if (!member || !cursor_string_equals(name, name_count, escaped, member->name, member->name_count))  *same = false;
+                walk_cursor(state, member, same);
+                if (member)  member = member->next;
+            }
+            if (member)  *same = false;
+            break;
+        }
+        case json_type_array: {
+            reference_value* element = reference ? reference->first : NULL;
+            json_cursor_enter_array(state);
+            while (json_cursor_next_element(state)) {
+                walk_cursor(state, element, same);
+                if (element)  element = element->next;
+                else          *same = false;
+            }
+            if (element)  *same = false;
+            break;
+        }
+        case json_type_string: {
+            const char* chars;
+            size_t count;
+            bool escaped;
+            if (json_cursor_read_string(state, &chars, &count, &escaped) && reference &&
+                !cursor_string_equals(chars, count, escaped, reference->chars, reference->count)) {
+                *same = false;
+            }
+            break;
+        }
+        case json_type_number: {
+            json_number number;
+            if (json_cursor_read_number(state, &number) && reference && number.number != reference->number)  *same = false;
+            break;
+        }
+        default:
+            json_cursor_skip_value(state);
+            break;
+    }
+}
+
+// Walks document with cursor API and compares it with document parsed by reference parser, which is null if
+// document is invalid.
+document_check check_document_cursor(const char* text, int text_size, reference_value* reference) {
+    json_state state;
+    json_cursor_begin(&state, text, text_size);
+
+    bool same = true;
+    const char* now = cursor_peek(&state);
+    if (now && *now == '{') {
+        walk_cursor(&state, reference, &same);
+    } else {
+        json_cursor_enter_object(&state);  // Fails, root must be object.
+    }
+
+    bool accepted = state.valid && !cursor_peek(&state);  // Only whitespace may follow root object.
+    return get_document_check(accepted, same, reference);
+}
+
+// Visits every top-level member and skips its value, like collection_load_model() does for note types it doesn't need.
+bool parse_document_cursor(const char* text, int text_size) {
+    json_state state;
+    json_cursor_begin(&state, text, text_size);
+    if (!json_cursor_enter_object(&state))
+        return false;
+
+    const char* name;
+    size_t name_count;
+    while (json_cursor_next_member(&state, &name, &name_count)) {
+        if (!json_cursor_skip_value(&state))
+            return false;
+    }
+    return state.valid;
+}
+
+typedef bool (*parse_document_proc)(const char* text, int text_size);
+
+void run_document_benchmark(const char* name, parse_document_proc parse_document, const char* text, int text_size) {
+    double best_time = 1e9;
+    int runs = max(BENCHMARK_RUNS, (int)(BENCHMARK_RUNS * 1024 * 1024 / (text_size + 1)));  // Small documents are run more times.
+    for (int run = 0; run < runs; ++run) {
+        LARGE_INTEGER tick_start = get_tick();
+        verify(parse_document(text, text_size));
+        best_time = min(best_time, seconds_since(tick_start));
+    }
+
+    printf("  %-20s %8.2lf MB/s %10.2lf us/document\n", name, text_size / best_time / (1024 * 1024), best_time * 1e6);
+}
+
+// Measures json_parse() and json_free() separately and counts memory allocations made for document.
+void run_dom_benchmark(const char* text, int text_size) {
+    double best_parse_time = 1e9;
+    double best_free_time = 1e9;
+    size_t allocations_count = 0;
+    int runs = max(BENCHMARK_RUNS, (int)(BENCHMARK_RUNS * 1024 * 1024 / (text_size + 1)));
+    for (int run = 0; run < runs; ++run) {
+        json_state state;
+
+        LARGE_INTEGER tick_start = get_tick();
+        verify(json_parse(&state, text, text_size));
+        best_parse_time = min(best_parse_time, seconds_since(tick_start));
+
+        allocations_count = state.allocations_count;
+
+        tick_start = get_tick();
+        json_free(&state);
+        best_free_time = min(best_free_time, seconds_since(tick_start));
+    }
+
+    double megabytes = text_size / (1024.0 * 1024.0);
+    printf("  %-20s %8.2lf MB/s %10.2lf us/document %8.2lf allocations/MB %8.2lf us in json_free()\n",
+        "json_parse", megabytes / best_parse_time, best_parse_time * 1e6, allocations_count / megabytes, best_free_time * 1e6);
+}
+
+void benchmark_document(const char* text, int text_size) {
+    reference_value* reference = reference_parse_document(text, text_size);
+    printf("  json_parse %s\n", document_check_names[check_document_parse(text, text_size, reference)]);
+    printf("  cursor walk %s\n", document_check_names[check_document_cursor(text, text_size, reference)]);
+    reference_free(reference);
+
+    run_dom_benchmark(text, text_size);
+    run_document_benchmark("cursor", parse_document_cursor, text, text_size);
+}
+
+void benchmark_models() {
+    static const int models_counts[] = { 1, 10, 100, 500 };
+    for (int i = 0; i < (int)ARRAYSIZE(models_counts); ++i) {
+        int text_size = 0;
+        char* text = generate_models_text(models_counts[i], &text_size);
+
+        printf("Models JSON with %d note types (%d bytes):\n", models_counts[i], text_size);
+        benchmark_document(text, text_size);
+
+        free(text);
+    }
+}
+
+// Files passed in command line are benchmarked too, e.g. 'col.models' exported from real collection.
+void benchmark_files(int count, char** paths) {
+    for (int i = 0; i < count; ++i) {
+        int text_size = 0;
+        char* text = read_file(paths[i], &text_size);
+        if (!text) {
+            printf("Failed to read \"%s\".\n", paths[i]);
+            continue;
+        }
+
+        printf("%s (%d bytes):\n", paths[i], text_size);
+        benchmark_document(text, text_size);
+
+        free(text);
+    }
+}
+
+void print_document_checks(const char* name, const int* checks) {
+    printf("  %-12s %d with different values, %d wrongly accepted, %d wrongly rejected\n", name,
+        checks[document_different_values], checks[document_wrongly_accepted], checks[document_wrongly_rejected]);
+}
+
+typedef char* (*generate_document_proc)(int* text_size);
+
+// Cross-checks json_parse() and cursor walk against reference parser on generated documents.
+void verify_documents(const char* title, generate_document_proc generate_document, int count) {
+    printf("%s:\n", title);
+
+    int parse_checks[document_checks_count] = {};
+    int cursor_checks[document_checks_count] = {};
+    int rejected_count = 0;
+    bool printed = false;
+    for (int i = 0; i < count; ++i) {
+        int text_size = 0;
+        char* text = generate_document(&text_size);
+        reference_value* reference = reference_parse_document(text, text_size);
+        if (!reference)  ++rejected_count;
+
+        document_check parse_check = check_document_parse(text, text_size, reference);
+        document_check cursor_check = check_document_cursor(text, text_size, reference);
+        if ((parse_check != document_match || cursor_check != document_match) && !printed) {
+            printf("  First mismatching document (json_parse %s, cursor walk %s):\n%.*s\n",
+                document_check_names[parse_check], document_check_names[cursor_check], min(text_size, 4096), text);
+            printed = true;
+        }
+        ++parse_checks[parse_check];
+        ++cursor_checks[cursor_check];
+
+        reference_free(reference);
+        free(text);
+    }
+
+    printf("  %d of %d are rejected by reference parser\n", rejected_count, count);
+    print_document_checks("json_parse", parse_checks);
+    print_document_checks("cursor walk", cursor_checks);
+}
+
+int main(int argc, char** argv) {
+    verify_documents("Random documents", generate_random_document, RANDOM_DOCUMENTS_COUNT);
+    verify_documents("Malformed documents", generate_malformed_document, MALFORMED_DOCUMENTS_COUNT);
+    benchmark_numbers();
+    benchmark_models();
+    benchmark_files(argc - 1, argv + 1);
+    return 0;
+}
@@ -3,6 +3,10 @@
 #include <Windows.h>
 #include <assert.h>
 #include <strsafe.h>
+#include <intrin.h>
+#include <immintrin.h>
+#pragma comment(lib, "Normaliz.lib")  // NormalizeString(), Normaliz.dll is delay-loaded (look at project), so it's loaded only if keys are normalized.
+#pragma comment(lib, "delayimp.lib")
 #define JSON_IMPLEMENTATION
 #include "json.h"
 #include "sqlite3.h"
@@ -15,17 +19,86 @@ const char* collection_filename = R"(C:\Users\Vladislav\AppData\Roaming\Anki2\Us
 const char* collection_model_name = "Japanese Vocab";         // Name of model to lookup stuff.
 const char* collection_primary_field_name = "Word";           // Name of primary field that contains word that can be looked up.
 const char* collection_annotation_field_name = "Recording";   // Annotation that will be prepended to words containing primary field.
+const char* collection_key_field_names[] = { NULL };          // Other fields that notes are found by when no primary field matches, in order of priority,
+                                                              // e.g. { "Reading", "Kana" }. None by default. Fields that model doesn't have are ignored.
+const char* collection_key_separators = ",;、/";              // Key fields (but not primary field) can list several keys separated by these characters.
 
 const bool  drop_lines_without_word = true;  // Do not store store lines without words to annotate in memory and don't write them back to annotated file.
+const bool  annotate_every_word = false;     // Annotate all words found in line instead of only the first one, each note once per line.
 const bool  sort_output_lines = true;        // Apply sorting procedure to lines just before writing them to disk (look at sort_lines())
+const bool  lazy_annotation_loading = false; // Load only primary fields at startup and fetch annotation fields just for notes that were found in file (look at load_note_annotations()).
+const bool  snapshot_collection = false;     // Copy collection into memory before reading it, so collection that is open in Anki is locked only during the copy (look at open_collection()).
+const bool  strip_primary_html = false;      // Remove HTML tags and entities from primary field when notes are loaded, so "<b>食べる</b>" matches "食べる" (look at strip_html()).
+const bool  strip_annotation_html = false;   // Same for annotation field, e.g. when it contains formatted meaning instead of sound.
+const bool  normalize_keys = false;          // Apply Unicode NFKC to primary fields and words, so half-width katakana and full-width Latin match regular ones (look at normalize_key()).
+const bool  fold_kana = false;               // Also turn katakana into hiragana, so "カメラ" matches "かめら". Checksum lookup can't be used with it.
+const bool  deinflect_words = false;         // When word has no note, undo its conjugation by suffix rules, so "食べました" finds "食べる" (look at deinflect()).
+const bool  precompute_inflections = false;  // Generate conjugated forms of all notes when they are loaded, so most conjugated words are found by one hash lookup
+                                             // (look at build_inflection_index()). Needs all notes, so they are loaded by full scan.
+const bool  bloom_filter = false;            // Check words against Bloom filter of all keys before searching for them, so most words without notes
+                                             // are rejected without binary search (look at build_bloom_filter()).
+const bool  prefix_fallback = false;         // When word has no note, use note of the longest key that word starts with, so "日本語で" finds "日本語" (look at find_prefix_key()).
+const int   fuzzy_max_distance = 0;          // When word has no note after all of the above, use note of the closest key within this many inserted, deleted or replaced
+                                             // characters (1 or 2, 0 disables it), for typos and OCR errors (look at build_fuzzy_index()). Needs all notes,
+                                             // so they are loaded by full scan.
+const int   fuzzy_characters_per_edit = 3;   // Words and keys need this many characters for each allowed edit, so short words don't match unrelated keys.
+const char* fuzzy_marker = "(?)";            // Written before annotation of word that was found by fuzzy lookup.
+
+// Which note is used when several notes have the same key, e.g. homographs (look at compare_note_keys()):
+//   DUPLICATE_NOTES_NEWEST     - the one that was modified last.
+//   DUPLICATE_NOTES_LOWEST_ID  - the one that was added first.
+//   DUPLICATE_NOTES_FIRST_DECK - the one that has a card in the oldest deck (deck with the lowest id).
+//   DUPLICATE_NOTES_ALL        - annotations of all of them are written, in order of note ids.
+//   Remaining ties are broken by note id, so the same collection always gives the same output.
+enum DuplicateNotes { DUPLICATE_NOTES_NEWEST, DUPLICATE_NOTES_LOWEST_ID, DUPLICATE_NOTES_FIRST_DECK, DUPLICATE_NOTES_ALL };
+const DuplicateNotes duplicate_notes = DUPLICATE_NOTES_LOWEST_ID;
+
+// How notes are loaded from collection (look at build_note_cache()):
+//   NOTE_LOOKUP_FULL_SCAN - load all notes of model and look words up in memory, best when file has a lot of words.
+//   NOTE_LOOKUP_TARGETED  - put words into temporary table and load only notes that match them. SQLite still reads every note, since
+//                           fields can't be indexed, but notes that don't match are not copied, kept and sorted, so it's best when model
+//                           has far more notes than file has words, or more than fit into memory.
+//   NOTE_LOOKUP_CHECKSUM  - find notes for each word through Anki's index on notes.csum, fastest for small files, but works only when
+//                           primary field is the first field of model, and matches words case sensitively and only if primary field
+//                           is already normalized.
+//   NOTE_LOOKUP_AUTOMATIC - choose one of the above based on amount of distinct words in file and amount of notes of model.
+enum NoteLookupStrategy { NOTE_LOOKUP_AUTOMATIC, NOTE_LOOKUP_FULL_SCAN, NOTE_LOOKUP_TARGETED, NOTE_LOOKUP_CHECKSUM };
+const NoteLookupStrategy note_lookup_strategy = NOTE_LOOKUP_AUTOMATIC;
+const int checksum_lookup_notes_per_word = 16;   // Automatic strategy picks checksum lookup when model has at least this many notes per distinct word.
+const int targeted_lookup_notes_per_word = 256;  // Otherwise it picks targeted lookup when model has at least this many notes per distinct word
+                                                 // or more than MAX_NOTES notes.
+
+// How words are found in lines of file:
+//   WORD_MODE_FIRST_RUN    - runs of CJK and kana characters in line are words, works for vocabulary lists (look at parse_annotation_file()).
+//   WORD_MODE_DICTIONARY   - keys of all notes are searched for anywhere in line, works for sentences and prose (look at build_dictionary()).
+//   WORD_MODE_SEGMENTATION - line is split into known words by path with the lowest cost through all keys found in it, works for dense
+//                            text where leftmost key is often wrong (look at segment_text()).
+//   Dictionary and segmentation modes need all notes, so they are always loaded by full scan.
+enum WordMode { WORD_MODE_FIRST_RUN, WORD_MODE_DICTIONARY, WORD_MODE_SEGMENTATION };
+const WordMode word_mode = WORD_MODE_FIRST_RUN;
+
+// Costs of words in segmentation mode, the path through line with the lowest sum of costs is chosen.
+const int segmentation_word_cost = 100;              // Cost of each known word, so fewer words are preferred.
+const int segmentation_character_cost = -10;         // Added for each character of known word, so longer words are preferred.
+const int segmentation_kana_word_cost = 50;          // Added for words of kana only, short ones like "は" or "で" often match inside other words.
+const int segmentation_unknown_character_cost = 500; // Cost of each character that is not part of known word.
+const int segmentation_key_field_cost = 20;          // Added for words found by key field instead of primary field, for each step of priority.
 
 // Look at different implementations near procedure write_annotations()
 #define write_annotations_impl write_annotations_v3
 
 // Determines amount of reserved virtual memory for internal buffers.
 enum { MAX_NOTES = 0x16000 };  // Maximum amount of notes that can be loaded from Anki.
+enum { MAX_NOTE_KEYS = 0x58000 };  // Maximum amount of keys of all notes, each note has a key for primary field and keys for key fields.
 enum { MAX_LINES = 0x16000 };  // Maximum amount of lines that can be processed from source file.
+enum { MAX_SPANS = 0x40000 };  // Maximum amount of words that can be found in all lines of source file.
 enum { MAX_CHARACTER_BUFFER_SIZE = 0x96000 };  // Maximum amount of characters in character buffer.
+enum { MAX_DICTIONARY_STATES = 0x1000000 };    // Maximum amount of states (slots of double array) that dictionary automaton can grow to.
+enum { MAX_DEINFLECTIONS = 128 };               // Maximum amount of forms that one word can be deinflected to.
+enum { INFLECTION_INDEX_DEPTH = 2 };            // Amount of rules applied to each note by build_inflection_index(), deeper forms are left to deinflect().
+enum { BLOOM_BITS_PER_KEY = 16 };              // Size of Bloom filter, more bits give fewer false positives.
+enum { MAX_FUZZY_KEY_SIZE = 32 };               // Keys and words with more characters than this are skipped by fuzzy lookup.
+enum { ANNOTATION_BATCH_SIZE = 500 };           // Amount of notes which annotations are requested by one query in lazy mode, must be below SQLITE_MAX_VARIABLE_NUMBER.
 
 // Not settings anymore.
 
@@ -35,6 +108,29 @@ enum { MAX_CHARACTER_BUFFER_SIZE = 0x96000 };  // Maximum amount of characters i
 #define verify assert
 #endif
 
+void log_message(const char* format, ...) {
+    char message[512] = { 0 };
+
+    va_list args;
+    va_start(args, format);
+    StringCchVPrintfA(message, ARRAYSIZE(message), format, args);
+    va_end(args);
+
+    WriteConsoleA(GetStdHandle(STD_OUTPUT_HANDLE), message, strlen(message), NULL, NULL);
+}
+
+inline LARGE_INTEGER get_tick() {
+    LARGE_INTEGER tick;
+    QueryPerformanceCounter(&tick);
+    return tick;
+}
+
+inline double seconds_since(LARGE_INTEGER tick_start) {
+    LARGE_INTEGER clock_frequency;
+    QueryPerformanceFrequency(&clock_frequency);
+    return (get_tick().QuadPart - tick_start.QuadPart) / (double)clock_frequency.QuadPart;
+}
+
 char* read_file(const char* filename, int* filesize) {
     assert(filename);
 
@@ -161,6 +257,30 @@ inline int read_utf8_codepoint(char** source, int length) {
     return UNICODE_INVALID_CHARACTER;
 }
 
+// Writes UTF-8 encoding of 'c' to 'dest' and advances it by 1-4 characters.
+inline void write_utf8_codepoint(char** dest, int c) {
+    unsigned char* d = *(unsigned char**)dest;
+    if (c <= 0x7F) {
+        d[0] = (unsigned char)c;
+        *dest += 1;
+    } else if (c <= 0x7FF) {
+        d[0] = (unsigned char)(0b11000000 | (c >> 6));
+        d[1] = (unsigned char)(0b10000000 | (c & 0x3F));
+        *dest += 2;
+    } else if (c <= 0xFFFF) {
+        d[0] = (unsigned char)(0b11100000 | (c >> 12));
+        d[1] = (unsigned char)(0b10000000 | ((c >> 6) & 0x3F));
+        d[2] = (unsigned char)(0b10000000 | (c & 0x3F));
+        *dest += 3;
+    } else {
+        d[0] = (unsigned char)(0b11110000 | (c >> 18));
+        d[1] = (unsigned char)(0b10000000 | ((c >> 12) & 0x3F));
+        d[2] = (unsigned char)(0b10000000 | ((c >> 6) & 0x3F));
+        d[3] = (unsigned char)(0b10000000 | (c & 0x3F));
+        *dest += 4;
+    }
+}
+
 inline bool is_cjk_codepoint(int c) {
     return
         (c >= 0x4E00 && c <= 0x9FFF)   ||  // CJK Unified Ideographs
@@ -175,7 +295,9 @@ inline bool is_cjk_codepoint(int c) {
 inline bool is_kana_codepoint(int c) {
     return
         (c >= 0x3040 && c <= 0x309F) ||    // Hiragana
-        (c >= 0x30A0 && c <= 0x30FF);      // Katakana, Katakana Phonetic Extensions, Halfwidth Katakana
+        (c >= 0x30A0 && c <= 0x30FF) ||    // Katakana
+        (c >= 0x31F0 && c <= 0x31FF) ||    // Katakana Phonetic Extensions
+        (c >= 0xFF66 && c <= 0xFF9F);      // Halfwidth Katakana
 }
 
 inline bool is_space_codepoint(int c) {
@@ -184,11 +306,18 @@ inline bool is_space_codepoint(int c) {
         c == '\t';
 }
 
+struct Note;
+char* normalize_line(char* line, char* line_end, char** text_end, int** offsets);
+
 struct ResultLine {
     char* line = NULL;
     char* line_end = NULL;
-    char* word = NULL;
-    char* word_end = NULL;
+    char* text = NULL;      // Line without linebreak after normalize_line(), words are found in it.
+    char* text_end = NULL;
+    int* offsets = NULL;    // Offset in 'line' of each byte of 'text' and of its end, NULL if 'text' is 'line' itself.
+    int first_span = 0;     // Words of line are 'spans[first_span]' up to 'spans[last_span]' (exclusive).
+    int last_span = 0;
+    Note* note = NULL;      // Note of first word that has one, set by resolve_result_lines().
 };
 
 static ResultLine result_lines[MAX_LINES];
@@ -199,6 +328,25 @@ ResultLine* new_result_line() {
     return &result_lines[result_lines_count++];
 }
 
+// Word found in line. Spans of all lines share one array and spans of each line are contiguous,
+// so line only keeps their range and words point into line's text by offset.
+// Flag shares bits with length, so span takes 12 bytes.
+struct Span {
+    int offset;                 // From start of line's text, in bytes.
+    unsigned int length : 31;
+    unsigned int fuzzy  : 1;    // Key was found by find_fuzzy_key() and only resembles word.
+    int key;                    // Index of first matching key in 'note_keys' or -1 if word has no note.
+};
+static_assert(sizeof(Span) == 12, "Span should take 12 bytes");
+
+static Span spans[MAX_SPANS];
+static int spans_count = 0;
+
+void add_span(int offset, int length, int key) {
+    verify(spans_count < MAX_SPANS);
+    spans[spans_count++] = { offset, (unsigned int)length, false, key };
+}
+
 void parse_annotation_file() {
     char* const file_contents = read_file(annotate_filename, NULL);
     char* lines = file_contents;
@@ -214,17 +362,21 @@ void parse_annotation_file() {
         if (!line)  break;  // No more lines.
         ++lc;
 
-        char* prev_line_chars = line;
-        char* curr_line_chars = line;
+        // Words are searched in normalized line, so they are keys already.
+        char* text_end = NULL;
+        int* offsets = NULL;
+        char* text = normalize_line(line, line_end, &text_end, &offsets);
 
-        char* annotation_word = NULL;
-        char* annotation_word_end = NULL;
+        int first_span = spans_count;
+        char* word = NULL;
+        char* now = text;
         bool  invalid_line = false;
 
-        while (curr_line_chars != line_end) {
-            prev_line_chars = curr_line_chars; 
+        // In dictionary mode words are found later, when notes are loaded (look at resolve_result_lines()).
+        while (word_mode == WORD_MODE_FIRST_RUN && now != text_end) {
+            char* character = now;
 
-            int codepoint = read_utf8_codepoint(&curr_line_chars, line_end - curr_line_chars);
+            int codepoint = read_utf8_codepoint(&now, text_end - now);
             if (codepoint == UNICODE_EOF) {
                 break;
             } else if (codepoint == UNICODE_INVALID_CHARACTER) {
@@ -232,120 +384,309 @@ void parse_annotation_file() {
                 invalid_line = true;
                 break;
             } else if (is_cjk_codepoint(codepoint) || is_kana_codepoint(codepoint)) {
-                if (!annotation_word) {
-                    annotation_word = prev_line_chars;
-                }
-                continue;
-            } else {
-                if (annotation_word)
-                    break;
-                else if (is_space_codepoint(codepoint))
-                    continue;
+                if (!word)  word = character;
+            } else if (word) {
+                add_span((int)(word - text), (int)(character - word), -1);
+                word = NULL;
+                if (!annotate_every_word)  break;
             }
         }
+        if (word && !invalid_line)  add_span((int)(word - text), (int)(now - word), -1);
 
         verify(!invalid_line);
 
-        if (drop_lines_without_word && annotation_word == NULL)
+        if (word_mode == WORD_MODE_FIRST_RUN && drop_lines_without_word && spans_count == first_span)
             continue;
 
         auto result_line = new_result_line();
         result_line->line = line;
         result_line->line_end = line_full_end;
-
-        if (annotation_word && !invalid_line) {
-            annotation_word_end = prev_line_chars;
-
-            result_line->word = annotation_word;
-            result_line->word_end = annotation_word_end;
-        }
+        result_line->text = text;
+        result_line->text_end = text_end;
+        result_line->offsets = offsets;
+        result_line->first_span = first_span;
+        result_line->last_span = spans_count;
     };
 }
 
 char collection_model_id[64];
 int collection_model_primary_field_index = -1;
 int collection_model_annotation_field_index = -1;
+int collection_model_key_field_indices[ARRAYSIZE(collection_key_field_names)];  // -1 for fields that model doesn't have.
+
+// Returns true if UTF-8 names are the same when case of all Unicode characters is ignored, like Anki compares names of note types
+// and fields. Characters are compared one by one with simple case folding of Windows, so the few characters that fold into
+// several ones (like "ß" into "ss") only match themselves.
+bool names_equal(const char* a, size_t a_count, const char* b) {
+    char* a_now = (char*)a;
+    char* a_end = a_now + a_count;
+    char* b_now = (char*)b;
+    char* b_end = b_now + strlen(b);
+
+    while (a_now < a_end && b_now < b_end) {
+        char* a_character = a_now;
+        char* b_character = b_now;
+        int a_codepoint = read_utf8_codepoint(&a_now, a_end - a_now);
+        int b_codepoint = read_utf8_codepoint(&b_now, b_end - b_now);
+        if (a_codepoint == UNICODE_INVALID_CHARACTER || b_codepoint == UNICODE_INVALID_CHARACTER)  return false;
+        if (a_codepoint == b_codepoint)  continue;
+
+        wchar_t a_wide[2];
+        wchar_t b_wide[2];
+        int a_wide_count = MultiByteToWideChar(CP_UTF8, 0, a_character, a_now - a_character, a_wide, ARRAYSIZE(a_wide));
+        int b_wide_count = MultiByteToWideChar(CP_UTF8, 0, b_character, b_now - b_character, b_wide, ARRAYSIZE(b_wide));
+        if (CSTR_EQUAL != CompareStringOrdinal(a_wide, a_wide_count, b_wide, b_wide_count, TRUE))  return false;
+    }
+    return a_now == a_end && b_now == b_end;
+}
 
-void collection_load_model(sqlite3* db) {
-    char* query = "SELECT models FROM col";
+// Returns variable that receives ord of field with name 'name' or NULL if we don't need that field.
+int* find_model_field_index(const char* name, size_t count) {
+    if (names_equal(name, count, collection_primary_field_name)) {
+        return &collection_model_primary_field_index;
+    } else if (names_equal(name, count, collection_annotation_field_name)) {
+        return &collection_model_annotation_field_index;
+    }
+
+    for (int i = 0; i < ARRAYSIZE(collection_key_field_names); ++i) {
+        if (!collection_key_field_names[i])  continue;
+        if (names_equal(name, count, collection_key_field_names[i]))  return &collection_model_key_field_indices[i];
+    }
+    return NULL;
+}
+
+bool collection_model_has_key_fields() {
+    for (int i = 0; i < ARRAYSIZE(collection_key_field_names); ++i) {
+        if (collection_model_key_field_indices[i] != -1)  return true;
+    }
+    return false;
+}
+
+// Returns ", mod, <deck>" and ", anki_field(flds, N)" for each key field that model has, load_note() expects them after annotation field.
+// Deck is looked up in cards only when it breaks ties between notes.
+void format_note_columns(char* columns, size_t columns_size) {
+    StringCchCopyA(columns, columns_size, duplicate_notes == DUPLICATE_NOTES_FIRST_DECK ? ", mod, (SELECT MIN(did) FROM cards WHERE nid = notes.id)" : ", mod, 0");
+    for (int i = 0; i < ARRAYSIZE(collection_key_field_names); ++i) {
+        if (collection_model_key_field_indices[i] == -1)  continue;
+
+        char column[32] { 0 };
+        StringCchPrintfA(column, ARRAYSIZE(column), ", anki_field(flds, %d)", collection_model_key_field_indices[i]);
+        StringCchCatA(columns, columns_size, column);
+    }
+}
+
+// Newer collections store models in 'notetypes' table and their fields in 'fields' table instead of JSON in 'col.models'.
+bool collection_has_notetypes(sqlite3* db) {
+    const char* query = "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = 'notetypes'";
 
     sqlite3_stmt* stmt = NULL;
-    verify(SQLITE_OK == sqlite3_prepare_v2(db, query, strlen(query)+1, &stmt, 0));
+    verify(SQLITE_OK == sqlite3_prepare_v2(db, query, strlen(query)+1, &stmt, NULL));
 
     int status = sqlite3_step(stmt);
-    verify(status != SQLITE_DONE);  // Row not found.
-    verify(status == SQLITE_ROW);   
+    verify(status == SQLITE_ROW || status == SQLITE_DONE);
 
-    char* json_text = (char*)sqlite3_column_text(stmt, 0);
-    verify(json_text);
+    verify(SQLITE_OK == sqlite3_finalize(stmt));
+    stmt = NULL;
 
-    json_text = _strdup(json_text);
-    verify(json_text);
+    return status == SQLITE_ROW;
+}
 
-    sqlite3_finalize(stmt);
-    stmt = NULL;
-    
-    json_state state;
-    verify(json_parse(&state, json_text, strlen(json_text)));
+// Finds model and its fields in tables of newer collections. Names of note types are compared by names_equal() rather than by
+// index on 'name', since its 'unicase' collation folds only ASCII here (look at sql_unicase_collation()), and there are few note types.
+void collection_load_model_from_notetypes(sqlite3* db) {
+    sqlite3_int64 model_id = 0;
+    {
+        const char* query = "SELECT id, name FROM notetypes";
 
-    json_object* Model = NULL;
+        sqlite3_stmt* stmt = NULL;
+        verify(SQLITE_OK == sqlite3_prepare_v2(db, query, strlen(query)+1, &stmt, NULL));
 
-    auto root = state.root;
-    for (auto ModelMember = root->first; ModelMember; ModelMember = ModelMember->next) {
-        auto XModel = ModelMember->value->as_object();
-        verify(XModel);
+        bool found = false;
+        while (!found) {
+            int status = sqlite3_step(stmt);
+            verify(status != SQLITE_DONE);  // Model missing.
+            verify(status == SQLITE_ROW);
 
-        auto model_name = XModel->get_string("name");
-        if (!model_name)  continue;
-        if (model_name->count != strlen(collection_model_name))  continue;
-        if (0 != _strnicmp(model_name->chars, collection_model_name, strlen(collection_model_name)))  continue;
+            const char* name = (const char*)sqlite3_column_text(stmt, 1);
+            if (!name)  continue;
 
-        verify(0 == strncpy_s(collection_model_id, ModelMember->name, ModelMember->name_count));
+            found = names_equal(name, sqlite3_column_bytes(stmt, 1), collection_model_name);
+            model_id = sqlite3_column_int64(stmt, 0);
+        }
+        StringCchPrintfA(collection_model_id, ARRAYSIZE(collection_model_id), "%lld", model_id);
 
-        Model = XModel;
-        break;
+        verify(SQLITE_OK == sqlite3_finalize(stmt));
+        stmt = NULL;
     }
+    {
+        const char* query = "SELECT ord, name FROM fields WHERE ntid = ?";
 
-    verify(Model);  // Model missing.
+        sqlite3_stmt* stmt = NULL;
+        verify(SQLITE_OK == sqlite3_prepare_v2(db, query, strlen(query)+1, &stmt, NULL));
+        verify(SQLITE_OK == sqlite3_bind_int64(stmt, 1, model_id));
 
-    auto Fields = Model->get_array("flds");
-    verify(Fields);
+        while (true) {
+            int status = sqlite3_step(stmt);
+            if (status == SQLITE_DONE)  break;
+            verify(status == SQLITE_ROW);
 
-    for (auto FieldMember = Fields->first; FieldMember; FieldMember = FieldMember->next) {
-        auto XField = FieldMember->value->as_object();
-        verify(XField);
+            const char* field_name = (const char*)sqlite3_column_text(stmt, 1);
+            if (!field_name)  continue;
 
-        auto field_name = XField->get_string("name");
-        if (!field_name)  continue;
+            int* field_index = find_model_field_index(field_name, sqlite3_column_bytes(stmt, 1));
+            if (!field_index)  continue;
 
-        int* field_index = NULL;
+            *field_index = sqlite3_column_int(stmt, 0);
+        }
 
-        // @TODO: Use UTF-8 string comparison (sqlite3_stricmp)
+        verify(SQLITE_OK == sqlite3_finalize(stmt));
+        stmt = NULL;
+    }
 
-        if (field_name->count == strlen(collection_primary_field_name) &&
-            0 == _strnicmp(field_name->chars, collection_primary_field_name, strlen(collection_primary_field_name)))
-        {
-            field_index = &collection_model_primary_field_index;
+    verify(collection_model_primary_field_index != -1);
+    verify(collection_model_annotation_field_index != -1);
+}
+
+inline bool equals_ignore_case(const char* chars, size_t count, const char* string) {
+    return count == strlen(string) && 0 == _strnicmp(chars, string, count);
+}
+
+// Names with escape sequences are decoded here, buffer grows to fit the longest of them.
+char* json_string_buffer = NULL;
+size_t json_string_buffer_size = 0;
+
+// Returns string read by json.h cursor with escape sequences decoded to 'json_string_buffer', if it has any.
+// Decoded string stays valid until next call.
+const char* decode_json_string(const char* chars, size_t* count, bool escaped) {
+    if (!escaped)  return chars;
+
+    // Decoded string is never longer than its escaped form.
+    if (*count > json_string_buffer_size) {
+        json_string_buffer_size = max(*count, (size_t)1024);
+        json_string_buffer = (char*)realloc(json_string_buffer, json_string_buffer_size);
+        verify(json_string_buffer);
+    }
+    *count = json_decode_string(chars, *count, json_string_buffer);
+    return json_string_buffer;
+}
+
+// Walks models JSON with json.h cursor: only names of models and their fields are looked at,
+// everything else (templates, CSS, LaTeX) is skipped without being parsed into values.
+void collection_load_model_from_json(sqlite3* db) {
+    char* query = "SELECT models FROM col";
+
+    sqlite3_stmt* stmt = NULL;
+    verify(SQLITE_OK == sqlite3_prepare_v2(db, query, strlen(query)+1, &stmt, 0));
+
+    int status = sqlite3_step(stmt);
+    verify(status != SQLITE_DONE);  // Row not found.
+    verify(status == SQLITE_ROW);   
+
+    // Text stays valid until statement is finalized.
+    const char* json_text = (const char*)sqlite3_column_text(stmt, 0);
+    int json_text_count = sqlite3_column_bytes(stmt, 0);
+    verify(json_text);
+
+    json_state state;
+    json_cursor_begin(&state, json_text, json_text_count);
+    verify(json_cursor_enter_object(&state));
+
+    const char* fields_position = NULL;  // Position of "flds" array of model.
+
+    const char* model_id = NULL;
+    size_t model_id_count = 0;
+    while (json_cursor_next_member(&state, &model_id, &model_id_count)) {
+        verify(json_cursor_enter_object(&state));
+
+        bool is_model = false;
+        const char* model_fields_position = NULL;
+
+        const char* key = NULL;
+        size_t key_count = 0;
+        while (json_cursor_next_member(&state, &key, &key_count)) {
+            if (equals_ignore_case(key, key_count, "name")) {
+                const char* model_name = NULL;
+                size_t model_name_count = 0;
+                bool model_name_escaped = false;
+                verify(json_cursor_read_string(&state, &model_name, &model_name_count, &model_name_escaped));
+
+                model_name = decode_json_string(model_name, &model_name_count, model_name_escaped);
+
+                is_model = names_equal(model_name, model_name_count, collection_model_name);
+            } else if (equals_ignore_case(key, key_count, "flds")) {
+                model_fields_position = state.now;
+                verify(json_cursor_skip_value(&state));
+            } else {
+                verify(json_cursor_skip_value(&state));
+            }
         }
-        else if (field_name->count == strlen(collection_annotation_field_name) &&
-                 0 == _strnicmp(field_name->chars, collection_annotation_field_name, strlen(collection_annotation_field_name)))
-        {
-            field_index = &collection_model_annotation_field_index;
-        } 
-        else {
-            continue;
+        verify(state.valid);
+
+        if (is_model) {
+            verify(0 == strncpy_s(collection_model_id, model_id, model_id_count));
+            fields_position = model_fields_position;
+            break;
+        }
+    }
+    verify(state.valid);
+
+    verify(fields_position);  // Model missing or it doesn't have fields.
+
+    state.now = fields_position;
+    verify(json_cursor_enter_array(&state));
+
+    while (json_cursor_next_element(&state)) {
+        verify(json_cursor_enter_object(&state));
+
+        const char* field_name = NULL;
+        size_t field_name_count = 0;
+        bool field_name_escaped = false;
+        json_number ord;
+        bool has_ord = false;
+
+        const char* key = NULL;
+        size_t key_count = 0;
+        while (json_cursor_next_member(&state, &key, &key_count)) {
+            if (equals_ignore_case(key, key_count, "name")) {
+                verify(json_cursor_read_string(&state, &field_name, &field_name_count, &field_name_escaped));
+            } else if (equals_ignore_case(key, key_count, "ord")) {
+                verify(json_cursor_read_number(&state, &ord));
+                has_ord = true;
+            } else {
+                verify(json_cursor_skip_value(&state));
+            }
         }
+        verify(state.valid);
+
+        if (!field_name)  continue;
+
+        field_name = decode_json_string(field_name, &field_name_count, field_name_escaped);
 
-        auto Ord = XField->get_number("ord");
-        verify(Ord);
+        int* field_index = find_model_field_index(field_name, field_name_count);
+        if (!field_index)  continue;
 
-        *field_index = (int)Ord->number;
+        verify(has_ord);
+        *field_index = (int)ord.integer;
     }
+    verify(state.valid);
+
+    verify(SQLITE_OK == sqlite3_finalize(stmt));
+    stmt = NULL;
 
     verify(collection_model_primary_field_index != -1);
     verify(collection_model_annotation_field_index != -1);
+}
 
-    json_free(&state);
+void collection_load_model(sqlite3* db) {
+    for (int i = 0; i < ARRAYSIZE(collection_key_field_names); ++i) {
+        collection_model_key_field_indices[i] = -1;
+    }
+
+    if (collection_has_notetypes(db)) {
+        collection_load_model_from_notetypes(db);
+    } else {
+        collection_load_model_from_json(db);
+    }
 }
 
 char character_buffer[MAX_CHARACTER_BUFFER_SIZE];
@@ -359,10 +700,187 @@ char* new_character_buffer_entry(int count) {
     return result;
 }
 
+enum { MAX_NORMALIZED_KEY_SIZE = 256 };  // Texts longer than this (in UTF-16 characters) are not words and are left as is.
+enum { MAX_NORMALIZED_KEY_BYTES = MAX_NORMALIZED_KEY_SIZE * 4 * 3 };  // Size of the longest normalized key in UTF-8.
+
+// Returns true if 'c' is known to stay the same after normalize_key(), unless it's followed by combining character.
+inline bool is_normalized_codepoint(int c) {
+    if (c < 0x80)  return true;
+    if (c >= 0x3041 && c <= 0x3096)  return true;  // Hiragana, without combining voiced marks.
+    if (c >= 0x309D && c <= 0x309E)  return true;  // Hiragana iteration marks.
+    if (((c >= 0x30A1 && c <= 0x30FA) || (c >= 0x30FD && c <= 0x30FE)) && !fold_kana)  return true;  // Katakana.
+    if (c == 0x30FC)  return true;                 // Prolonged sound mark.
+    if (c >= 0x3001 && c <= 0x3002)  return true;  // Ideographic comma and full stop.
+    if (c == 0x3005)  return true;                 // Ideographic iteration mark.
+    if (c >= 0x300C && c <= 0x300F)  return true;  // Corner brackets.
+    if (c >= 0x4E00 && c <= 0x9FFF)  return true;  // CJK Unified Ideographs.
+    return false;
+}
+
+// Returns true if NFKC can compose 'c' with character before it: combining marks, voiced sound marks (also half-width ones)
+// and Hangul vowels and final consonants.
+inline bool is_combining_codepoint(int c) {
+    return
+        (c >= 0x0300 && c <= 0x036F) ||
+        (c >= 0x1160 && c <= 0x11FF) ||
+        (c >= 0x1AB0 && c <= 0x1AFF) ||
+        (c >= 0x1DC0 && c <= 0x1DFF) ||
+        (c >= 0x20D0 && c <= 0x20FF) ||
+        (c >= 0x3099 && c <= 0x309A) ||
+        (c >= 0xFE20 && c <= 0xFE2F) ||
+        (c >= 0xFF9E && c <= 0xFF9F);
+}
+
+// Returns true if 'text' is known to stay the same after normalize_key(): it consists only of ASCII, hiragana,
+// katakana (unless it's folded), CJK ideographs and common punctuation, which is what most of words, fields and lines are made of.
+bool is_normalized_key(const char* text, const char* text_end) {
+    // ASCII is skipped 16 characters at a time.
+    while (text_end - text >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)text);
+        if (_mm_movemask_epi8(chunk))  break;
+        text += 16;
+    }
+
+    char* now = (char*)text;
+    while (now < text_end) {
+        if (!is_normalized_codepoint(read_utf8_codepoint(&now, text_end - now)))  return false;
+    }
+    return true;
+}
+
+// Converts 'text' to UTF-16 in NFKC and folds katakana into hiragana if 'fold_kana' is enabled.
+// Returns amount of stored characters or -1 if text is too long to be a key.
+int normalize_to_wide(const char* text, const char* text_end, wchar_t* normalized, int normalized_capacity) {
+    wchar_t wide[MAX_NORMALIZED_KEY_SIZE];
+    int wide_count = MultiByteToWideChar(CP_UTF8, 0, text, text_end - text, wide, ARRAYSIZE(wide));
+    if (wide_count <= 0)  return -1;
+
+    int normalized_count = NormalizeString(NormalizationKC, wide, wide_count, normalized, normalized_capacity);
+    if (normalized_count <= 0)  return -1;
+
+    if (fold_kana) {
+        for (int i = 0; i < normalized_count; ++i) {
+            wchar_t c = normalized[i];
+            if ((c >= 0x30A1 && c <= 0x30F6) || (c >= 0x30FD && c <= 0x30FE))  normalized[i] = c - 0x60;
+        }
+    }
+    return normalized_count;
+}
+
+// Stores normalized 'text' to 'key' (MAX_NORMALIZED_KEY_BYTES) and returns its size. Returns -1 if text stays the same
+// after normalization or is too long to be a key, so it's used as is.
+int normalize_key_to(const char* text, const char* text_end, char* key) {
+    if ((!normalize_keys && !fold_kana) || is_normalized_key(text, text_end))  return -1;
+
+    wchar_t normalized[MAX_NORMALIZED_KEY_SIZE * 4];
+    int normalized_count = normalize_to_wide(text, text_end, normalized, ARRAYSIZE(normalized));
+    if (normalized_count < 0)  return -1;
+
+    int key_size = WideCharToMultiByte(CP_UTF8, 0, normalized, normalized_count, key, MAX_NORMALIZED_KEY_BYTES, NULL, NULL);
+    verify(key_size > 0);
+
+    // Text that is already normalized but wasn't recognized by is_normalized_key().
+    if (key_size == text_end - text && memcmp(key, text, key_size) == 0)  return -1;
+    return key_size;
+}
+
+// Returns lookup key for 'text': the text itself when it's already normalized, otherwise its normalized copy in character_buffer.
+// Both primary fields and words in file go through it, so they match when they differ only by width, compatibility characters
+// or (with 'fold_kana') by kana.
+char* normalize_key(char* text, char* text_end, char** key_end) {
+    char normalized[MAX_NORMALIZED_KEY_BYTES];
+    int key_size = normalize_key_to(text, text_end, normalized);
+
+    *key_end = text_end;
+    if (key_size < 0)  return text;
+
+    char* key = new_character_buffer_entry(key_size);
+    memcpy(key, normalized, key_size);
+    *key_end = key + key_size;
+    return key;
+}
+
+enum { MAX_LINE_PIECE_SIZE = 64 };  // Characters of line that change after normalization are normalized by pieces of at most this many characters.
+
+// Line is normalized here before it's copied to memory of its own, scratch grows to fit the longest normalized line.
+char* line_scratch = NULL;
+int* line_scratch_offsets = NULL;
+int line_scratch_capacity = 0;
+
+void reserve_line_scratch(int count) {
+    if (count <= line_scratch_capacity)  return;
+
+    line_scratch_capacity = max(count, max(0x1000, line_scratch_capacity * 2));
+    line_scratch = (char*)realloc(line_scratch, line_scratch_capacity);
+    line_scratch_offsets = (int*)realloc(line_scratch_offsets, line_scratch_capacity * sizeof(int));
+    verify(line_scratch && line_scratch_offsets);
+}
+
+// Returns 'line' normalized like words are by normalize_key(), so words found in it are keys already. Lines can be much longer
+// than keys, so characters that change are normalized by pieces that never end before combining character. Normalized line
+// is allocated with malloc() rather than in character_buffer, which holds notes, and '*offsets' receives offset in 'line'
+// of each of its bytes and of its end (look at ResultLine). Returns line itself and sets '*offsets' to NULL when it's normalized already.
+char* normalize_line(char* line, char* line_end, char** text_end, int** offsets) {
+    *text_end = line_end;
+    *offsets = NULL;
+    if ((!normalize_keys && !fold_kana) || is_normalized_key(line, line_end))  return line;
+
+    int count = 0;
+    char* now = line;
+    while (now < line_end) {
+        char* piece = now;
+        bool changes = false;
+
+        int c = read_utf8_codepoint(&now, line_end - now);
+        if (c == UNICODE_INVALID_CHARACTER) {
+            now = piece + 1;  // Kept as is, so parse_annotation_file() rejects the line.
+        } else {
+            changes = !is_normalized_codepoint(c);
+            for (int piece_count = 1; now < line_end; ++piece_count) {
+                char* next = now;
+                int d = read_utf8_codepoint(&next, line_end - next);
+                if (d == UNICODE_INVALID_CHARACTER)  break;
+
+                if (is_combining_codepoint(d))  changes = true;
+                else if (!changes || is_normalized_codepoint(d) || piece_count >= MAX_LINE_PIECE_SIZE)  break;
+                now = next;
+            }
+        }
+
+        int piece_size = (int)(now - piece);
+        reserve_line_scratch(count + max(piece_size, (int)MAX_NORMALIZED_KEY_BYTES) + 1);
+
+        int size = changes ? normalize_key_to(piece, now, &line_scratch[count]) : -1;
+        if (size < 0) {
+            memcpy(&line_scratch[count], piece, piece_size);
+            for (int i = 0; i < piece_size; ++i)  line_scratch_offsets[count + i] = (int)(piece - line) + i;
+            count += piece_size;
+        } else {
+            for (int i = 0; i < size; ++i)  line_scratch_offsets[count + i] = (int)(piece - line);
+            count += size;
+        }
+    }
+    line_scratch_offsets[count] = (int)(line_end - line);
+
+    char* text = (char*)malloc(count);
+    *offsets = (int*)malloc((count + 1) * sizeof(int));
+    verify(text && *offsets);
+    memcpy(text, line_scratch, count);
+    memcpy(*offsets, line_scratch_offsets, (count + 1) * sizeof(int));
+
+    *text_end = text + count;
+    return text;
+}
+
 struct Note {
+    sqlite3_int64 id = 0;
+    sqlite3_int64 mod = 0;     // Modification time, in seconds.
+    sqlite3_int64 deck = 0;    // Lowest id of decks which have cards of note, only loaded for DUPLICATE_NOTES_FIRST_DECK.
     char* primary = NULL;      // All strings come from character_buffer, don't deallocate.
     char* primary_end = NULL;
-    char* annotate = NULL;
+    char* key = NULL;          // Primary field after normalize_key(), notes are sorted and looked up by it.
+    char* key_end = NULL;
+    char* annotate = NULL;     // NULL until load_note_annotations() is called when lazy_annotation_loading is enabled.
     char* annotate_end = NULL;
 };
 Note notes[MAX_NOTES];
@@ -373,196 +891,2321 @@ Note* new_note() {
     return &notes[notes_count++];
 }
 
-// 'indices' must be sorted in ascending order.
-void find_seperated_strings(char separator, const char* source, int count, int* indices, char** starts, char** ends) {
+// Key that note can be found by. Keys of all notes are sorted together, so one lookup finds notes by any key field.
+struct NoteKey {
+    char* key = NULL;
+    char* key_end = NULL;
+    int note = -1;     // Index in 'notes'.
+    int priority = 0;  // 0 for primary field, 1 + index in 'collection_key_field_names' for key fields. Lower is preferred.
+    int group_end = 0; // Keys from first one with the same text and priority up to this one (exclusive) are duplicates, set by group_note_keys().
+};
+NoteKey note_keys[MAX_NOTE_KEYS];
+int note_keys_count = 0;
+
+void add_note_key(char* key, char* key_end, int note, int priority) {
+    verify(note_keys_count < MAX_NOTE_KEYS);
+    NoteKey* note_key = &note_keys[note_keys_count++];
+    note_key->key = key;
+    note_key->key_end = key_end;
+    note_key->note = note;
+    note_key->priority = priority;
+}
+
+inline int count_trailing_zeros(unsigned int mask) {
+    assert(mask != 0);
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (int)index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+enum { MAX_SEPERATED_STRINGS = 256 };  // Maximum index of string that can be requested from find_seperated_strings().
+
+// Splits 'source' into strings by 'separator' and stores offsets of strings with requested 'indices' (in any order) to 'starts' and 'ends'.
+// Offset in 'ends' points one character past the end of string, so last string ends at 'source_count'.
+// Separators are searched 16 or 32 characters at a time and search stops after last requested string.
+// Returns false if 'source' contains less strings than requested, or index is negative or not below MAX_SEPERATED_STRINGS.
+bool find_seperated_strings(char separator, const char* source, int source_count, const int* indices, int count, int* starts, int* ends) {
     assert(source);
+    assert(source_count >= 0);
     assert(count > 0);
     assert(indices);
     assert(starts);
     assert(ends);
 
-    int current_separator = -1;
-    const char* previous_separator_position = source;
-    int current_index = *indices++;
-    
-    char c;
-    do {
-        c = *source;
-        if (c == separator || c == '\0') {
-            ++current_separator;
-
-            if (current_separator == current_index) {
-                *starts++ = (char*)previous_separator_position;
-                *ends++   = (char*)source - 1;
-                --count;
-                if (count == 0)  break;
-                current_index = *indices++;
+    int max_index = 0;
+    for (int i = 0; i < count; ++i) {
+        if (indices[i] < 0 || indices[i] >= MAX_SEPERATED_STRINGS)  return false;
+        max_index = max(max_index, indices[i]);
+    }
+
+    // separator_positions[i] is a position of separator that ends string with index i.
+    int separator_positions[MAX_SEPERATED_STRINGS];
+    int separators_count = 0;
+    int position = 0;
+
+#ifdef __AVX2__
+    const __m256i separator32 = _mm256_set1_epi8(separator);
+    for (; position + 32 <= source_count; position += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)(source + position));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, separator32));
+        for (; mask; mask &= mask - 1) {
+            separator_positions[separators_count++] = position + count_trailing_zeros(mask);
+            if (separators_count > max_index)  goto found;
+        }
+    }
+#endif
+
+    {
+        const __m128i separator16 = _mm_set1_epi8(separator);
+        for (; position + 16 <= source_count; position += 16) {
+            __m128i chunk = _mm_loadu_si128((const __m128i*)(source + position));
+            unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, separator16));
+            for (; mask; mask &= mask - 1) {
+                separator_positions[separators_count++] = position + count_trailing_zeros(mask);
+                if (separators_count > max_index)  goto found;
             }
+        }
+    }
 
-            previous_separator_position = source + 1;
-            if (c == '\0')  break;
+    for (; position < source_count; ++position) {
+        if (source[position] == separator) {
+            separator_positions[separators_count++] = position;
+            if (separators_count > max_index)  goto found;
         }
-        ++source;
-    } while (true);
+    }
 
-    // @TODO: Probably doesn't work with last separator (or maybe it does since it treats \0 as separator). 
+    // Last string isn't followed by separator.
+    separator_positions[separators_count++] = source_count;
 
-    assert(count == 0);
+found:
+    for (int i = 0; i < count; ++i) {
+        int index = indices[i];
+        if (index >= separators_count)  return false;
+
+        starts[i] = index == 0 ? 0 : separator_positions[index - 1] + 1;
+        ends[i]   = separator_positions[index];
+    }
+    return true;
 }
 
-int __cdecl compare_notes(void const* aa, void const* bb) {
-    Note* a = (Note*)aa;
-    Note* b = (Note*)bb;
+// Returns position of first '<' or '&' in range or 'end', searching 16 or 32 characters at a time.
+const char* find_html_markup(const char* now, const char* end) {
+#ifdef __AVX2__
+    const __m256i less32 = _mm256_set1_epi8('<');
+    const __m256i ampersand32 = _mm256_set1_epi8('&');
+    for (; now + 32 <= end; now += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)now);
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, less32), _mm256_cmpeq_epi8(chunk, ampersand32)));
+        if (mask)  return now + count_trailing_zeros(mask);
+    }
+#endif
+
+    const __m128i less16 = _mm_set1_epi8('<');
+    const __m128i ampersand16 = _mm_set1_epi8('&');
+    for (; now + 16 <= end; now += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)now);
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, less16), _mm_cmpeq_epi8(chunk, ampersand16)));
+        if (mask)  return now + count_trailing_zeros(mask);
+    }
 
-    return sqlite3_strnicmp(a->primary, b->primary, max(a->primary_end - a->primary, b->primary_end - b->primary));
+    while (now < end && *now != '<' && *now != '&')  ++now;
+    return now;
 }
 
-void build_note_cache(sqlite3* db) {
-    char query[64] { 0 };
-    StringCchPrintfA(query, ARRAYSIZE(query), "SELECT flds FROM notes WHERE mid = %s", collection_model_id);
+// Returns position of first occurence of 'string' in range, ignoring case, or NULL.
+const char* find_string_ignore_case(const char* now, const char* end, const char* string) {
+    int count = strlen(string);
+    for (; end - now >= count; ++now) {
+        if (0 == _strnicmp(now, string, count))  return now;
+    }
+    return NULL;
+}
 
-    sqlite3_stmt* stmt = NULL;
-    verify(SQLITE_OK == sqlite3_prepare_v2(db, query, strlen(query)+1, &stmt, NULL));
+// Elements which contents are not text of field: styles, scripts and readings of ruby annotations (furigana).
+const char* html_elements_without_text[] = { "style", "script", "rt", "rp" };
 
-    while (true) {
-        int status = sqlite3_step(stmt);
-        if (status == SQLITE_DONE)  break;
-        verify(status == SQLITE_ROW);
+// Returns position after tag that starts at 'now' (and after contents of elements without text), or NULL if '<' doesn't start a tag.
+const char* skip_html_tag(const char* now, const char* end) {
+    assert(*now == '<');
+
+    if (end - now >= 4 && 0 == memcmp(now, "<!--", 4)) {
+        const char* comment_end = find_string_ignore_case(now + 4, end, "-->");
+        return comment_end ? comment_end + 3 : end;
+    }
 
-        const char* fields = (const char*)sqlite3_column_text(stmt, 0);
-        verify(fields);
+    const char* tag_end = (const char*)memchr(now, '>', end - now);
+    if (!tag_end)  return NULL;
 
-        const int total_fields = 2;
+    for (int i = 0; i < ARRAYSIZE(html_elements_without_text); ++i) {
+        const char* name = html_elements_without_text[i];
+        int name_count = strlen(name);
+        if (end - now <= name_count + 1 || 0 != _strnicmp(now + 1, name, name_count))  continue;
 
-        int   field_indices[total_fields];
-        if (collection_model_primary_field_index < collection_model_annotation_field_index) {
-            field_indices[0] = collection_model_primary_field_index;
-            field_indices[1] = collection_model_annotation_field_index;
-        } else {
-            field_indices[0] = collection_model_annotation_field_index;
-            field_indices[1] = collection_model_primary_field_index;
+        char next = now[1 + name_count];
+        if (next != '>' && next != ' ' && next != '\t' && next != '\n' && next != '/')  continue;
+
+        char closing_tag[16] { 0 };
+        StringCchPrintfA(closing_tag, ARRAYSIZE(closing_tag), "</%s", name);
+        const char* closing = find_string_ignore_case(tag_end + 1, end, closing_tag);
+        if (!closing)  return end;
+
+        const char* closing_end = (const char*)memchr(closing, '>', end - closing);
+        return closing_end ? closing_end + 1 : end;
+    }
+
+    return tag_end + 1;
+}
+
+// Decodes entity that starts at 'now' to 'dest' and returns position after it, or returns NULL if entity is not known.
+// Decoded character is never longer than entity, so text can be decoded in place.
+const char* decode_html_entity(const char* now, const char* end, char** dest) {
+    assert(*now == '&');
+
+    const char* semicolon = (const char*)memchr(now, ';', min(end - now, (ptrdiff_t)12));
+    if (!semicolon)  return NULL;
+
+    const char* name = now + 1;
+    int name_count = semicolon - name;
+
+    if (name_count >= 2 && name[0] == '#') {
+        bool hex = name[1] == 'x' || name[1] == 'X';
+        int c = 0;
+        int digits = 0;
+        for (const char* digit = name + (hex ? 2 : 1); digit < semicolon; ++digit, ++digits) {
+            int value;
+            if (*digit >= '0' && *digit <= '9')              value = *digit - '0';
+            else if (hex && *digit >= 'a' && *digit <= 'f')  value = *digit - 'a' + 10;
+            else if (hex && *digit >= 'A' && *digit <= 'F')  value = *digit - 'A' + 10;
+            else                                             return NULL;
+            c = c * (hex ? 16 : 10) + value;
+            if (c > 0x10FFFF)  return NULL;
         }
-        char* field_starts[total_fields];
-        char* field_ends[total_fields];
+        if (!digits || c == 0 || (c >= 0xD800 && c <= 0xDFFF))  return NULL;
 
-        find_seperated_strings(0x1f, fields, total_fields, field_indices, field_starts, field_ends);
+        write_utf8_codepoint(dest, c == 0xA0 ? ' ' : c);
+        return semicolon + 1;
+    }
 
-        auto note = new_note();
-        {
-            int primary_size = field_ends[0] - field_starts[0] + 1;
-            note->primary = strncpy(new_character_buffer_entry(primary_size), field_starts[0], primary_size);
-            note->primary_end = note->primary + primary_size;
+    // Anki turns non-breaking spaces into regular ones when it strips HTML.
+    static const struct { const char* name; char c; } entities[] = {
+        { "nbsp", ' ' }, { "amp", '&' }, { "lt", '<' }, { "gt", '>' }, { "quot", '"' }, { "apos", '\'' },
+    };
+    for (int i = 0; i < ARRAYSIZE(entities); ++i) {
+        if (name_count == strlen(entities[i].name) && 0 == memcmp(name, entities[i].name, name_count)) {
+            *(*dest)++ = entities[i].c;
+            return semicolon + 1;
         }
-        {
-            int annotate_size = field_ends[1] - field_starts[1] + 1;
-            note->annotate = strncpy(new_character_buffer_entry(annotate_size), field_starts[1], annotate_size);
-            note->annotate_end = note->annotate + annotate_size;
+    }
+    return NULL;
+}
+
+inline bool is_html_whitespace(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// Removes HTML tags, comments and contents of elements without text from 'text', decodes entities and trims whitespace.
+// Works in place in one pass, text between markup is found with SIMD and moved at once. Returns new length of text.
+int strip_html(char* text, int count) {
+    const char* now = text;
+    const char* end = text + count;
+    char* dest = text;
+
+    while (now < end) {
+        const char* markup = find_html_markup(now, end);
+        memmove(dest, now, markup - now);
+        dest += markup - now;
+        now = markup;
+        if (now >= end)  break;
+
+        const char* next = *now == '<' ? skip_html_tag(now, end) : decode_html_entity(now, end, &dest);
+        if (next) {
+            now = next;
+        } else {
+            *dest++ = *now++;  // Not a tag or entity, keep character as is.
         }
     }
 
-    verify(SQLITE_OK == sqlite3_finalize(stmt));
-    stmt = NULL;
+    char* start = text;
+    while (start < dest && is_html_whitespace(*start))  ++start;
+    while (dest > start && is_html_whitespace(dest[-1]))  --dest;
 
-    qsort(notes, notes_count, sizeof(Note), compare_notes);
+    memmove(text, start, dest - start);
+    return dest - start;
 }
 
-Note* find_note(const char* primary, const char* primary_end) {
-    Note placeholder;
-    placeholder.primary = (char*)primary;
-    placeholder.primary_end = (char*)primary_end;
+// SQL function 'anki_field(flds, ord)': returns field with index 'ord' from note fields or NULL if note has no such field.
+// Lets queries return only fields we need instead of whole 'flds' column.
+void sql_anki_field(sqlite3_context* context, int argc, sqlite3_value** argv) {
+    assert(argc == 2);
+
+    const char* fields = (const char*)sqlite3_value_text(argv[0]);
+    int fields_count = sqlite3_value_bytes(argv[0]);
+    int field_index = sqlite3_value_int(argv[1]);
+    if (!fields) {
+        sqlite3_result_null(context);
+        return;
+    }
+
+    int field_start = 0;
+    int field_end = 0;
+    if (!find_seperated_strings(0x1f, fields, fields_count, &field_index, 1, &field_start, &field_end)) {
+        sqlite3_result_null(context);
+        return;
+    }
 
-    return (Note*)bsearch(&placeholder, notes, notes_count, sizeof(Note), compare_notes);
+    sqlite3_result_text(context, fields + field_start, field_end - field_start, SQLITE_TRANSIENT);
 }
 
-// All lines with annotations.
-void write_annotations_v1(HANDLE annotated_file) {
-    int can_apply = 0;
-    for (int i = 0; i < result_lines_count; ++i) {
-        auto& result_line = result_lines[i];
-        if (result_line.word != NULL) {
-            Note* note = find_note(result_line.word, result_line.word_end);
-            if (note) {
-                can_apply++;
-
-                write_to_file(annotated_file, note->annotate, note->annotate_end - note->annotate);
-                write_to_file(annotated_file, result_line.line, result_line.line_end - result_line.line);
-                continue;
-            }
-        }
+// Collation 'unicase' that is used by newer collections for names of note types and fields, SQLite needs it to read these tables.
+// Anki folds case of all Unicode characters, this one folds only ASCII, so names are never looked up through it (look at names_equal()).
+int sql_unicase_collation(void* data, int a_count, const void* a, int b_count, const void* b) {
+    int result = sqlite3_strnicmp((const char*)a, (const char*)b, min(a_count, b_count));
+    return result != 0 ? result : a_count - b_count;
+}
 
-        // Line doesn't contain a word to annotate or word wasn't found in database.
-        // @TODO: Batch lines without words and write them as one chunk.
-        write_to_file(annotated_file, result_line.line, result_line.line_end - result_line.line);
+// SQL function 'strip_html(text)': returns text with HTML removed by strip_html(), lets queries match fields with markup.
+void sql_strip_html(sqlite3_context* context, int argc, sqlite3_value** argv) {
+    assert(argc == 1);
+
+    const char* text = (const char*)sqlite3_value_text(argv[0]);
+    int text_count = sqlite3_value_bytes(argv[0]);
+    if (!text) {
+        sqlite3_result_null(context);
+        return;
     }
-}
 
-// Only lines with annonations.
-void write_annotations_v2(HANDLE annotated_file) {
-    int can_apply = 0;
-    for (int i = 0; i < result_lines_count; ++i) {
-        auto& result_line = result_lines[i];
-        if (result_line.word != NULL) {
-            Note* note = find_note(result_line.word, result_line.word_end);
-            if (note) {
-                can_apply++;
-
-                write_to_file(annotated_file, note->annotate, note->annotate_end - note->annotate);
-                write_to_file(annotated_file, result_line.line, result_line.line_end - result_line.line);
-                continue;
-            }
-        }
+    char* stripped = (char*)sqlite3_malloc(text_count + 1);
+    if (!stripped) {
+        sqlite3_result_error_nomem(context);
+        return;
     }
-}
+    memcpy(stripped, text, text_count);
 
-// Only lines with annonations + trim spaces
-void write_annotations_v3(HANDLE annotated_file) {
-    int can_apply = 0;
-    for (int i = 0; i < result_lines_count; ++i) {
-        auto& result_line = result_lines[i];
-        if (result_line.word != NULL) {
-            Note* note = find_note(result_line.word, result_line.word_end);
-            if (note) {
-                can_apply++;
+    sqlite3_result_text(context, stripped, strip_html(stripped, text_count), sqlite3_free);
+}
 
-                write_to_file(annotated_file, note->annotate, note->annotate_end - note->annotate);
+// SQL function 'normalize_key(text)': returns text as normalize_key() would.
+void sql_normalize_key(sqlite3_context* context, int argc, sqlite3_value** argv) {
+    assert(argc == 1);
 
-                char* trim_line = result_line.line;
-                while (true) {
-                    char* now = trim_line;
-                    int codepoint = read_utf8_codepoint(&now, result_line.line_end - now);
-                    assert(codepoint != UNICODE_INVALID_CHARACTER);
-                    if (codepoint == 0)  break;
-                    if (is_space_codepoint(codepoint)) {
-                        trim_line = now;
-                    } else {
-                        break;
-                    }
-                }
+    const char* text = (const char*)sqlite3_value_text(argv[0]);
+    int text_count = sqlite3_value_bytes(argv[0]);
+    if (!text || is_normalized_key(text, text + text_count)) {
+        sqlite3_result_value(context, argv[0]);
+        return;
+    }
 
-                write_to_file(annotated_file, " ", 1);
-                write_to_file(annotated_file, trim_line, result_line.line_end - trim_line);
-                continue;
-            }
-        }
+    wchar_t normalized[MAX_NORMALIZED_KEY_SIZE * 4];
+    int normalized_count = normalize_to_wide(text, text + text_count, normalized, ARRAYSIZE(normalized));
+    if (normalized_count < 0) {
+        sqlite3_result_value(context, argv[0]);
+        return;
     }
+
+    char key[MAX_NORMALIZED_KEY_SIZE * 4 * 3];
+    int key_size = WideCharToMultiByte(CP_UTF8, 0, normalized, normalized_count, key, ARRAYSIZE(key), NULL, NULL);
+    verify(key_size > 0);
+
+    sqlite3_result_text(context, key, key_size, SQLITE_TRANSIENT);
 }
 
-int __cdecl compare_lines(void const* aa, void const* bb) {
-    auto a = (ResultLine*)aa;
-    auto b = (ResultLine*)bb;
+void register_sql_functions(sqlite3* db) {
+    verify(SQLITE_OK == sqlite3_create_function_v2(db, "anki_field", 2, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL, sql_anki_field, NULL, NULL, NULL));
+    verify(SQLITE_OK == sqlite3_create_function_v2(db, "strip_html", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL, sql_strip_html, NULL, NULL, NULL));
+    verify(SQLITE_OK == sqlite3_create_function_v2(db, "normalize_key", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL, sql_normalize_key, NULL, NULL, NULL));
+    verify(SQLITE_OK == sqlite3_create_collation_v2(db, "unicase", SQLITE_UTF8, NULL, sql_unicase_collation, NULL));
+}
 
-    Note* note_a = find_note(a->word, a->word_end);
-    Note* note_b = find_note(b->word, b->word_end);
+// Case insensitive comparison of strings that are not null-terminated.
+int compare_strings(const char* a, const char* a_end, const char* b, const char* b_end) {
+    int a_count = a_end - a;
+    int b_count = b_end - b;
 
-    if (note_a && note_b == NULL)  return -1;
-    if (note_a == NULL && note_b)  return  1;
+    int result = sqlite3_strnicmp(a, b, min(a_count, b_count));
+    return result != 0 ? result : a_count - b_count;
+}
 
-    const char prefix[] = "[sound:core/";
-    int prefix_length = ARRAYSIZE(prefix) - 1;
+// Same keys are ordered by priority and then by 'duplicate_notes', so the first one is preferred.
+int __cdecl compare_note_keys(void const* aa, void const* bb) {
+    auto a = (NoteKey*)aa;
+    auto b = (NoteKey*)bb;
 
-    if (note_a && note_b) {
-        int note_a_annotate_length = note_a->annotate_end - note_a->annotate;
-        int note_b_annotate_length = note_b->annotate_end - note_b->annotate;
+    int result = compare_strings(a->key, a->key_end, b->key, b->key_end);
+    if (result != 0)  return result;
+    if (a->priority != b->priority)  return a->priority - b->priority;
+
+    const Note* note_a = &notes[a->note];
+    const Note* note_b = &notes[b->note];
+    if (duplicate_notes == DUPLICATE_NOTES_NEWEST && note_a->mod != note_b->mod) {
+        return note_a->mod > note_b->mod ? -1 : 1;
+    }
+    if (duplicate_notes == DUPLICATE_NOTES_FIRST_DECK && note_a->deck != note_b->deck) {
+        return note_a->deck < note_b->deck ? -1 : 1;
+    }
+    return note_a->id < note_b->id ? -1 : (note_a->id > note_b->id ? 1 : 0);
+}
+
+// Called after keys are sorted, so lookups get all duplicates of found key without searching for them.
+void group_note_keys() {
+    for (int i = note_keys_count - 1; i >= 0; --i) {
+        const NoteKey* next = i + 1 < note_keys_count ? &note_keys[i + 1] : NULL;
+        bool same = next && next->priority == note_keys[i].priority &&
+                    compare_strings(next->key, next->key_end, note_keys[i].key, note_keys[i].key_end) == 0;
+        note_keys[i].group_end = same ? next->group_end : i + 1;
+    }
+}
+
+// Keys in 'note_keys' which notes annotate word that was found by 'key': just the key, or all its duplicates with DUPLICATE_NOTES_ALL.
+inline int duplicate_keys_end(int key) {
+    return duplicate_notes == DUPLICATE_NOTES_ALL ? note_keys[key].group_end : key + 1;
+}
+
+// Codepoints of 'collection_key_separators', decoded on first use.
+int key_separators[16];
+int key_separators_count = -1;
+
+inline bool is_key_separator(int c) {
+    if (key_separators_count == -1) {
+        key_separators_count = 0;
+        char* now = (char*)collection_key_separators;
+        char* end = now + strlen(now);
+        while (now < end) {
+            verify(key_separators_count < ARRAYSIZE(key_separators));
+            int separator = read_utf8_codepoint(&now, end - now);
+            verify(separator != UNICODE_INVALID_CHARACTER);
+            key_separators[key_separators_count++] = separator;
+        }
+    }
+
+    for (int i = 0; i < key_separators_count; ++i) {
+        if (key_separators[i] == c)  return true;
+    }
+    return false;
+}
+
+// Finds next key in field that lists keys separated by 'collection_key_separators', spaces around keys are skipped.
+// Start with '*now' set to start of field, returns false when there are no more keys.
+bool next_field_key(char** now, char* end, char** key, char** key_end) {
+    while (*now < end) {
+        char* start = *now;
+        char* stop = end;
+        while (*now < end) {
+            char* character = *now;
+            int codepoint = read_utf8_codepoint(now, end - *now);
+            if (codepoint == UNICODE_INVALID_CHARACTER) {
+                *now = character + 1;  // Invalid UTF-8 byte is kept in key, it can't be a separator.
+            } else if (is_key_separator(codepoint)) {
+                stop = character;
+                break;
+            }
+        }
+
+        while (start < stop && (*start == ' ' || *start == '\t'))  ++start;
+        while (stop > start && (stop[-1] == ' ' || stop[-1] == '\t'))  --stop;
+        if (start < stop) {
+            *key = start;
+            *key_end = stop;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Copies field to character buffer, stripping HTML if 'strip' is set. Fields are stripped once when notes are loaded,
+// so lookups compare plain text. Returns copy and stores its end to 'copy_end'.
+char* copy_field(const char* field, int field_size, bool strip, char** copy_end) {
+    char* copy = strncpy(new_character_buffer_entry(field_size), field, field_size);
+    if (strip) {
+        int stripped_size = strip_html(copy, field_size);
+        character_buffer_count -= field_size - stripped_size;  // Copy is the last entry, give back space that is not used anymore.
+        field_size = stripped_size;
+    }
+
+    *copy_end = copy + field_size;
+    return copy;
+}
+
+// Stores note and its keys from current row of query with columns (id, primary field, annotation field, mod, deck, key fields...),
+// annotation field is left out of query when 'with_annotations' is false, key fields are the ones that model has (look at format_note_columns()).
+Note* load_note(sqlite3_stmt* stmt, bool with_annotations) {
+    const char* primary = (const char*)sqlite3_column_text(stmt, 1);
+    int primary_size = sqlite3_column_bytes(stmt, 1);
+    verify(primary);
+
+    auto note = new_note();
+    int note_index = notes_count - 1;
+    int column = 2;
+    if (with_annotations) {
+        const char* annotate = (const char*)sqlite3_column_text(stmt, column);
+        int annotate_size = sqlite3_column_bytes(stmt, column);
+        verify(annotate);  // Note doesn't have annotation field.
+
+        note->annotate = copy_field(annotate, annotate_size, strip_annotation_html, &note->annotate_end);
+        ++column;
+    }
+
+    note->id = sqlite3_column_int64(stmt, 0);
+    note->mod = sqlite3_column_int64(stmt, column++);
+    note->deck = sqlite3_column_int64(stmt, column++);
+    note->primary = copy_field(primary, primary_size, strip_primary_html, &note->primary_end);
+    note->key = normalize_key(note->primary, note->primary_end, &note->key_end);
+    add_note_key(note->key, note->key_end, note_index, 0);
+
+    for (int i = 0; i < ARRAYSIZE(collection_key_field_names); ++i) {
+        if (collection_model_key_field_indices[i] == -1)  continue;
+
+        const char* field = (const char*)sqlite3_column_text(stmt, column);
+        int field_size = sqlite3_column_bytes(stmt, column);
+        ++column;
+        if (!field || field_size == 0)  continue;
+
+        char* field_copy_end = NULL;
+        char* field_copy = copy_field(field, field_size, strip_primary_html, &field_copy_end);
+
+        char* now = field_copy;
+        char* key = NULL;
+        char* key_end = NULL;
+        while (next_field_key(&now, field_copy_end, &key, &key_end)) {
+            key = normalize_key(key, key_end, &key_end);
+            add_note_key(key, key_end, note_index, i + 1);
+        }
+    }
+    return note;
+}
+
+void load_notes(sqlite3* db, const char* query, bool with_annotations) {
+    sqlite3_stmt* stmt = NULL;
+    verify(SQLITE_OK == sqlite3_prepare_v2(db, query, strlen(query)+1, &stmt, NULL));
+
+    while (true) {
+        int status = sqlite3_step(stmt);
+        if (status == SQLITE_DONE)  break;
+        verify(status == SQLITE_ROW);
+
+        // Notes with empty primary field can't be looked up. They are skipped here instead of in WHERE, so fields are split once per row.
+        if (sqlite3_column_bytes(stmt, 1) == 0)  continue;
+
+        load_note(stmt, with_annotations);
+    }
+
+    verify(SQLITE_OK == sqlite3_finalize(stmt));
+    stmt = NULL;
+}
+
+// Loads all notes of the model.
+void load_all_notes(sqlite3* db) {
+    // In lazy mode annotation field is left out, it will be loaded by load_note_annotations().
+    char note_columns[256] { 0 };
+    format_note_columns(note_columns, ARRAYSIZE(note_columns));
+
+    char annotation_column[32] { 0 };
+    if (!lazy_annotation_loading) {
+        StringCchPrintfA(annotation_column, ARRAYSIZE(annotation_column), ", anki_field(flds, %d)", collection_model_annotation_field_index);
+    }
+
+    char query[512] { 0 };
+    StringCchPrintfA(
+        query,
+        ARRAYSIZE(query),
+        "SELECT id, anki_field(flds, %d)%s%s FROM notes WHERE mid = %s",
+        collection_model_primary_field_index,
+        annotation_column,
+        note_columns,
+        collection_model_id);
+
+    load_notes(db, query, !lazy_annotation_loading);
+}
+
+// Types of words that deinflection rules take and produce. Dictionary forms are what notes contain, others are intermediate forms.
+enum InflectionType {
+    INFLECTION_ICHIDAN   = 1 << 0,  // 食べる
+    INFLECTION_GODAN     = 1 << 1,  // 飲む
+    INFLECTION_SURU      = 1 << 2,  // する
+    INFLECTION_KURU      = 1 << 3,  // くる
+    INFLECTION_ADJECTIVE = 1 << 4,  // 高い, also forms that conjugate like it: 食べない, 食べたい.
+    INFLECTION_MASU      = 1 << 5,  // 食べます
+    INFLECTION_TE        = 1 << 6,  // 食べて
+
+    INFLECTION_DICTIONARY_FORMS = INFLECTION_ICHIDAN | INFLECTION_GODAN | INFLECTION_SURU | INFLECTION_KURU | INFLECTION_ADJECTIVE,
+    INFLECTION_ANY = INFLECTION_DICTIONARY_FORMS | INFLECTION_MASU | INFLECTION_TE,
+};
+
+// Rule replaces 'inflected' suffix of word which has one of 'types_in' types with 'base' suffix, and the result has 'types_out' types.
+struct DeinflectionRule {
+    char inflected[32];
+    char base[32];
+    int types_in;
+    int types_out;
+    int inflected_count;  // Set by init_deinflection_rules().
+    int base_count;
+};
+
+const DeinflectionRule deinflection_rules_table[] = {
+    // Polite forms, their stems are handled by rules for ます.
+    { "ました", "ます", INFLECTION_ANY, INFLECTION_MASU },
+    { "ません", "ます", INFLECTION_ANY, INFLECTION_MASU },
+    { "ませんでした", "ます", INFLECTION_ANY, INFLECTION_MASU },
+    { "ましょう", "ます", INFLECTION_ANY, INFLECTION_MASU },
+    { "まして", "ます", INFLECTION_ANY, INFLECTION_MASU },
+
+    // Progressive forms, ている itself is an ichidan verb.
+    { "ている", "て", INFLECTION_ICHIDAN, INFLECTION_TE },
+    { "でいる", "で", INFLECTION_ICHIDAN, INFLECTION_TE },
+
+    { "かった", "い", INFLECTION_ANY, INFLECTION_ADJECTIVE },
+    { "くない", "い", INFLECTION_ADJECTIVE, INFLECTION_ADJECTIVE },
+    { "くて", "い", INFLECTION_ANY, INFLECTION_ADJECTIVE },
+    { "く", "い", INFLECTION_ANY, INFLECTION_ADJECTIVE },
+    { "ければ", "い", INFLECTION_ANY, INFLECTION_ADJECTIVE },
+    { "さ", "い", INFLECTION_ANY, INFLECTION_ADJECTIVE },
+    { "そう", "い", INFLECTION_ANY, INFLECTION_ADJECTIVE },
+
+    { "ない", "る", INFLECTION_ADJECTIVE, INFLECTION_ICHIDAN },
+    { "ず", "る", INFLECTION_ANY, INFLECTION_ICHIDAN },
+    { "ます", "る", INFLECTION_MASU, INFLECTION_ICHIDAN },
+    { "たい", "る", INFLECTION_ADJECTIVE, INFLECTION_ICHIDAN },
+    { "て", "る", INFLECTION_TE, INFLECTION_ICHIDAN },
+    { "た", "る", INFLECTION_ANY, INFLECTION_ICHIDAN },
+    { "たら", "る", INFLECTION_ANY, INFLECTION_ICHIDAN },
+    { "れば", "る", INFLECTION_ANY, INFLECTION_ICHIDAN },
+    { "よう", "る", INFLECTION_ANY, INFLECTION_ICHIDAN },
+    { "ろ", "る", INFLECTION_ANY, INFLECTION_ICHIDAN },
+    { "られる", "る", INFLECTION_ICHIDAN, INFLECTION_ICHIDAN },
+    { "させる", "る", INFLECTION_ICHIDAN, INFLECTION_ICHIDAN },
+
+    { "しない", "する", INFLECTION_ADJECTIVE, INFLECTION_SURU },
+    { "せず", "する", INFLECTION_ANY, INFLECTION_SURU },
+    { "します", "する", INFLECTION_MASU, INFLECTION_SURU },
+    { "したい", "する", INFLECTION_ADJECTIVE, INFLECTION_SURU },
+    { "して", "する", INFLECTION_TE, INFLECTION_SURU },
+    { "した", "する", INFLECTION_ANY, INFLECTION_SURU },
+    { "したら", "する", INFLECTION_ANY, INFLECTION_SURU },
+    { "すれば", "する", INFLECTION_ANY, INFLECTION_SURU },
+    { "しよう", "する", INFLECTION_ANY, INFLECTION_SURU },
+    { "しろ", "する", INFLECTION_ANY, INFLECTION_SURU },
+    { "される", "する", INFLECTION_ICHIDAN, INFLECTION_SURU },
+    { "させる", "する", INFLECTION_ICHIDAN, INFLECTION_SURU },
+    { "できる", "する", INFLECTION_ICHIDAN, INFLECTION_SURU },
+
+    // With 来 kuru is conjugated as ichidan verb, these are for kana spelling.
+    { "こない", "くる", INFLECTION_ADJECTIVE, INFLECTION_KURU },
+    { "きます", "くる", INFLECTION_MASU, INFLECTION_KURU },
+    { "きたい", "くる", INFLECTION_ADJECTIVE, INFLECTION_KURU },
+    { "きて", "くる", INFLECTION_TE, INFLECTION_KURU },
+    { "きた", "くる", INFLECTION_ANY, INFLECTION_KURU },
+    { "くれば", "くる", INFLECTION_ANY, INFLECTION_KURU },
+    { "こよう", "くる", INFLECTION_ANY, INFLECTION_KURU },
+    { "こられる", "くる", INFLECTION_ICHIDAN, INFLECTION_KURU },
+
+    // 行く is the only godan verb with irregular te form.
+    { "行って", "行く", INFLECTION_TE, INFLECTION_GODAN },
+    { "行った", "行く", INFLECTION_ANY, INFLECTION_GODAN },
+    { "いって", "いく", INFLECTION_TE, INFLECTION_GODAN },
+    { "いった", "いく", INFLECTION_ANY, INFLECTION_GODAN },
+};
+
+// Godan verbs change last kana of dictionary form, so their rules are made from kana of each ending and suffixes that follow them.
+enum GodanStem { GODAN_STEM_A, GODAN_STEM_I, GODAN_STEM_E, GODAN_STEM_O, GODAN_STEM_TE, GODAN_STEM_TA, GODAN_STEMS_COUNT };
+
+struct GodanEnding {
+    const char* ending;
+    const char* stems[GODAN_STEMS_COUNT];
+};
+
+const GodanEnding godan_endings[] = {
+    { "う", { "わ", "い", "え", "お", "って", "った" } },
+    { "く", { "か", "き", "け", "こ", "いて", "いた" } },
+    { "ぐ", { "が", "ぎ", "げ", "ご", "いで", "いだ" } },
+    { "す", { "さ", "し", "せ", "そ", "して", "した" } },
+    { "つ", { "た", "ち", "て", "と", "って", "った" } },
+    { "ぬ", { "な", "に", "ね", "の", "んで", "んだ" } },
+    { "ぶ", { "ば", "び", "べ", "ぼ", "んで", "んだ" } },
+    { "む", { "ま", "み", "め", "も", "んで", "んだ" } },
+    { "る", { "ら", "り", "れ", "ろ", "って", "った" } },
+};
+
+struct GodanSuffix {
+    GodanStem stem;
+    const char* suffix;
+    int types_in;
+};
+
+const GodanSuffix godan_suffixes[] = {
+    { GODAN_STEM_A,  "ない", INFLECTION_ADJECTIVE },
+    { GODAN_STEM_A,  "ず",   INFLECTION_ANY },
+    { GODAN_STEM_A,  "れる", INFLECTION_ICHIDAN },  // Passive.
+    { GODAN_STEM_A,  "せる", INFLECTION_ICHIDAN },  // Causative.
+    { GODAN_STEM_I,  "ます", INFLECTION_MASU },
+    { GODAN_STEM_I,  "たい", INFLECTION_ADJECTIVE },
+    { GODAN_STEM_E,  "る",   INFLECTION_ICHIDAN },  // Potential.
+    { GODAN_STEM_E,  "ば",   INFLECTION_ANY },
+    { GODAN_STEM_E,  "",     INFLECTION_ANY },      // Imperative.
+    { GODAN_STEM_O,  "う",   INFLECTION_ANY },
+    { GODAN_STEM_TE, "",     INFLECTION_TE },
+    { GODAN_STEM_TA, "",     INFLECTION_ANY },
+    { GODAN_STEM_TA, "ら",   INFLECTION_ANY },
+};
+
+DeinflectionRule deinflection_rules[ARRAYSIZE(deinflection_rules_table) + ARRAYSIZE(godan_endings) * ARRAYSIZE(godan_suffixes)];
+int deinflection_rules_count = 0;
+
+// Fills 'deinflection_rules' from table and godan endings on first call.
+void init_deinflection_rules() {
+    if (deinflection_rules_count > 0)  return;
+
+    for (int i = 0; i < ARRAYSIZE(deinflection_rules_table); ++i) {
+        deinflection_rules[deinflection_rules_count++] = deinflection_rules_table[i];
+    }
+
+    for (int i = 0; i < ARRAYSIZE(godan_endings); ++i) {
+        for (int j = 0; j < ARRAYSIZE(godan_suffixes); ++j) {
+            DeinflectionRule* rule = &deinflection_rules[deinflection_rules_count++];
+            StringCchPrintfA(rule->inflected, ARRAYSIZE(rule->inflected), "%s%s", godan_endings[i].stems[godan_suffixes[j].stem], godan_suffixes[j].suffix);
+            StringCchPrintfA(rule->base, ARRAYSIZE(rule->base), "%s", godan_endings[i].ending);
+            rule->types_in = godan_suffixes[j].types_in;
+            rule->types_out = INFLECTION_GODAN;
+        }
+    }
+
+    for (int i = 0; i < deinflection_rules_count; ++i) {
+        deinflection_rules[i].inflected_count = (int)strlen(deinflection_rules[i].inflected);
+        deinflection_rules[i].base_count = (int)strlen(deinflection_rules[i].base);
+    }
+}
+
+enum { MAX_DEINFLECTION_SIZE = 96 };  // Maximum size of word in bytes that is deinflected, longer words are left as is.
+
+struct Deinflection {
+    char text[MAX_DEINFLECTION_SIZE];
+    int count;
+    int types;
+};
+
+inline bool ends_with(const char* text, int count, const char* suffix, int suffix_count) {
+    return count >= suffix_count && memcmp(text + count - suffix_count, suffix, suffix_count) == 0;
+}
+
+// Undoes conjugation of word by applying rules to it and to forms found before, breadth-first, so forms that need less rules come first.
+// First form is the word itself. Forms can be wrong, e.g. godan and ichidan rules both apply to "食べる", so only forms that match
+// a note mean anything. Returns amount of forms stored in 'forms'.
+int deinflect(const char* word, const char* word_end, Deinflection* forms, int capacity) {
+    assert(capacity > 0);
+    init_deinflection_rules();
+
+    int word_count = (int)(word_end - word);
+    if (word_count >= MAX_DEINFLECTION_SIZE)  return 0;
+
+    memcpy(forms[0].text, word, word_count);
+    forms[0].count = word_count;
+    forms[0].types = INFLECTION_ANY;
+    int forms_count = 1;
+
+    for (int i = 0; i < forms_count; ++i) {
+        for (int j = 0; j < deinflection_rules_count; ++j) {
+            const DeinflectionRule* rule = &deinflection_rules[j];
+            if (!(forms[i].types & rule->types_in))  continue;
+
+            int inflected_count = rule->inflected_count;
+            int base_count = rule->base_count;
+            if (!ends_with(forms[i].text, forms[i].count, rule->inflected, inflected_count))  continue;
+
+            int stem_count = forms[i].count - inflected_count;
+            if (stem_count + base_count >= MAX_DEINFLECTION_SIZE)  continue;
+
+            Deinflection form;
+            memcpy(form.text, forms[i].text, stem_count);
+            memcpy(form.text + stem_count, rule->base, base_count);
+            form.count = stem_count + base_count;
+            form.types = rule->types_out;
+
+            bool found = false;
+            for (int k = 0; k < forms_count && !found; ++k) {
+                found = forms[k].types == form.types && forms[k].count == form.count && memcmp(forms[k].text, form.text, form.count) == 0;
+            }
+            if (found)  continue;
+
+            if (forms_count == capacity)  return forms_count;
+            forms[forms_count++] = form;
+        }
+    }
+    return forms_count;
+}
+
+// Key that a note is looked up by when only notes for words of file are loaded.
+struct LookupKey {
+    const char* key;
+    const char* key_end;
+};
+
+int __cdecl compare_lookup_keys(void const* aa, void const* bb) {
+    auto a = (LookupKey*)aa;
+    auto b = (LookupKey*)bb;
+
+    return compare_strings(a->key, a->key_end, b->key, b->key_end);
+}
+
+void add_lookup_key(LookupKey** keys, int* keys_count, int* keys_capacity, const char* key, const char* key_end) {
+    if (*keys_count == *keys_capacity) {
+        *keys_capacity = max(256, *keys_capacity * 2);
+        *keys = (LookupKey*)realloc(*keys, *keys_capacity * sizeof(LookupKey));
+        verify(*keys);
+    }
+    (*keys)[(*keys_count)++] = { key, key_end };
+}
+
+// Collects distinct keys that resolve_result_lines() can look up for 'words': words themselves, their dictionary forms when
+// deinflection is enabled, and their prefixes that end on character boundary when prefix fallback is enabled.
+// Returns amount of keys, '*keys' is allocated with malloc().
+int collect_lookup_keys(const LookupKey* words, int words_count, LookupKey** keys) {
+    static Deinflection forms[MAX_DEINFLECTIONS];
+
+    *keys = NULL;
+    int keys_count = 0;
+    int keys_capacity = 0;
+
+    for (int i = 0; i < words_count; ++i) {
+        const char* word = words[i].key;
+        const char* word_end = words[i].key_end;
+        add_lookup_key(keys, &keys_count, &keys_capacity, word, word_end);
+
+        if (deinflect_words) {
+            int forms_count = deinflect(word, word_end, forms, ARRAYSIZE(forms));
+            for (int j = 1; j < forms_count; ++j) {
+                if (!(forms[j].types & INFLECTION_DICTIONARY_FORMS))  continue;
+
+                char* form = new_character_buffer_entry(forms[j].count);
+                memcpy(form, forms[j].text, forms[j].count);
+                add_lookup_key(keys, &keys_count, &keys_capacity, form, form + forms[j].count);
+            }
+        }
+
+        if (prefix_fallback) {
+            for (const char* prefix_end = word + 1; prefix_end < word_end; ++prefix_end) {
+                if (((unsigned char)*prefix_end & 0xC0) != 0x80)  add_lookup_key(keys, &keys_count, &keys_capacity, word, prefix_end);
+            }
+        }
+    }
+
+    qsort(*keys, keys_count, sizeof(LookupKey), compare_lookup_keys);
+
+    int distinct_count = 0;
+    for (int i = 0; i < keys_count; ++i) {
+        if (distinct_count == 0 || compare_lookup_keys(&(*keys)[distinct_count - 1], &(*keys)[i]) != 0) {
+            (*keys)[distinct_count++] = (*keys)[i];
+        }
+    }
+    return distinct_count;
+}
+
+// Sorted keys that sql_has_lookup_key() looks for.
+struct LookupKeys {
+    const LookupKey* keys;
+    int count;
+};
+
+// has_lookup_key(field): returns 1 if one of keys listed in key field is among lookup keys. Field is stripped and normalized
+// like in load_note(), but copies are made in memory of its own, since character_buffer holds notes that query is loading.
+void sql_has_lookup_key(sqlite3_context* context, int argc, sqlite3_value** argv) {
+    assert(argc == 1);
+    auto lookup_keys = (const LookupKeys*)sqlite3_user_data(context);
+
+    const char* field = (const char*)sqlite3_value_text(argv[0]);
+    int field_size = sqlite3_value_bytes(argv[0]);
+    if (!field) {
+        sqlite3_result_int(context, 0);
+        return;
+    }
+
+    char* field_copy = (char*)sqlite3_malloc(field_size + 1);
+    if (!field_copy) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    memcpy(field_copy, field, field_size);
+    char* field_copy_end = field_copy + (strip_primary_html ? strip_html(field_copy, field_size) : field_size);
+
+    bool found = false;
+    char* now = field_copy;
+    char* key = NULL;
+    char* key_end = NULL;
+    while (!found && next_field_key(&now, field_copy_end, &key, &key_end)) {
+        char normalized[MAX_NORMALIZED_KEY_BYTES];
+        int normalized_size = normalize_key_to(key, key_end, normalized);
+
+        LookupKey placeholder;
+        placeholder.key = normalized_size < 0 ? key : normalized;
+        placeholder.key_end = normalized_size < 0 ? key_end : normalized + normalized_size;
+        found = bsearch(&placeholder, lookup_keys->keys, lookup_keys->count, sizeof(LookupKey), compare_lookup_keys) != NULL;
+    }
+
+    sqlite3_free(field_copy);
+    sqlite3_result_int(context, found);
+}
+
+// Loads only notes which primary field or one of key fields matches one of 'keys'. Notes are still scanned by SQLite,
+// but only matching ones are copied out, and annotations are loaded right away since there are few of them.
+void load_matching_notes(sqlite3* db, const LookupKey* keys, int keys_count) {
+    verify(SQLITE_OK == sqlite3_exec(db, "CREATE TEMP TABLE lookup_words (word TEXT PRIMARY KEY COLLATE NOCASE) WITHOUT ROWID", NULL, NULL, NULL));
+    verify(SQLITE_OK == sqlite3_exec(db, "BEGIN", NULL, NULL, NULL));
+    {
+        const char* query = "INSERT OR IGNORE INTO lookup_words VALUES (?)";
+
+        sqlite3_stmt* stmt = NULL;
+        verify(SQLITE_OK == sqlite3_prepare_v2(db, query, strlen(query)+1, &stmt, NULL));
+
+        for (int i = 0; i < keys_count; ++i) {
+            verify(SQLITE_OK == sqlite3_bind_text(stmt, 1, keys[i].key, keys[i].key_end - keys[i].key, SQLITE_STATIC));
+            verify(SQLITE_DONE == sqlite3_step(stmt));
+            verify(SQLITE_OK == sqlite3_reset(stmt));
+        }
+
+        verify(SQLITE_OK == sqlite3_finalize(stmt));
+        stmt = NULL;
+    }
+    verify(SQLITE_OK == sqlite3_exec(db, "COMMIT", NULL, NULL, NULL));
+
+    // Primary field is compared as it is after load_note(): stripped and normalized.
+    bool normalize = normalize_keys || fold_kana;
+    char primary_key[128] { 0 };
+    StringCchPrintfA(
+        primary_key,
+        ARRAYSIZE(primary_key),
+        "%s%sanki_field(flds, %d)%s%s",
+        normalize ? "normalize_key(" : "",
+        strip_primary_html ? "strip_html(" : "",
+        collection_model_primary_field_index,
+        strip_primary_html ? ")" : "",
+        normalize ? ")" : "");
+
+    // Key fields can list several keys, so they are split and checked against 'keys' by has_lookup_key().
+    LookupKeys lookup_keys = { keys, keys_count };
+    verify(SQLITE_OK == sqlite3_create_function_v2(db, "has_lookup_key", 1, SQLITE_UTF8, &lookup_keys, sql_has_lookup_key, NULL, NULL, NULL));
+
+    char note_columns[256] { 0 };
+    format_note_columns(note_columns, ARRAYSIZE(note_columns));
+
+    char key_conditions[512] { 0 };
+    for (int i = 0; i < ARRAYSIZE(collection_key_field_names); ++i) {
+        if (collection_model_key_field_indices[i] == -1)  continue;
+
+        char condition[64] { 0 };
+        StringCchPrintfA(condition, ARRAYSIZE(condition), " OR has_lookup_key(anki_field(flds, %d))", collection_model_key_field_indices[i]);
+        StringCchCatA(key_conditions, ARRAYSIZE(key_conditions), condition);
+    }
+
+    char query[1024] { 0 };
+    StringCchPrintfA(
+        query,
+        ARRAYSIZE(query),
+        "SELECT id, anki_field(flds, %d), anki_field(flds, %d)%s FROM notes WHERE mid = %s AND (%s COLLATE NOCASE IN (SELECT word FROM temp.lookup_words)%s)",
+        collection_model_primary_field_index,
+        collection_model_annotation_field_index,
+        note_columns,
+        collection_model_id,
+        primary_key,
+        key_conditions);
+
+    load_notes(db, query, true);
+
+    verify(SQLITE_OK == sqlite3_exec(db, "DROP TABLE temp.lookup_words", NULL, NULL, NULL));
+}
+
+inline unsigned int rotate_left(unsigned int value, int count) {
+    return (value << count) | (value >> (32 - count));
+}
+
+void sha1_transform(unsigned int state[5], const unsigned char block[64]) {
+    unsigned int w[80];
+    for (int i = 0; i < 16; ++i) {
+        w[i] = (block[i * 4] << 24) | (block[i * 4 + 1] << 16) | (block[i * 4 + 2] << 8) | block[i * 4 + 3];
+    }
+    for (int i = 16; i < 80; ++i) {
+        w[i] = rotate_left(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+
+    unsigned int a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+    for (int i = 0; i < 80; ++i) {
+        unsigned int f, k;
+        if (i < 20)       { f = (b & c) | (~b & d);          k = 0x5A827999; }
+        else if (i < 40)  { f = b ^ c ^ d;                   k = 0x6ED9EBA1; }
+        else if (i < 60)  { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+        else              { f = b ^ c ^ d;                   k = 0xCA62C1D6; }
+
+        unsigned int temp = rotate_left(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = rotate_left(b, 30);
+        b = a;
+        a = temp;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+// Returns value that Anki stores in notes.csum for first field with contents 'text': first 32 bits of SHA-1 of field.
+// Anki strips HTML before calculating checksum, so 'text' must not contain it.
+unsigned int anki_field_checksum(const char* text, int count) {
+    assert(text);
+    assert(count >= 0);
+
+    unsigned int state[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+
+    int position = 0;
+    for (; position + 64 <= count; position += 64) {
+        sha1_transform(state, (const unsigned char*)text + position);
+    }
+
+    unsigned char block[128] = { 0 };
+    int tail_count = count - position;
+    memcpy(block, text + position, tail_count);
+    block[tail_count] = 0x80;
+
+    int block_count = tail_count + 9 <= 64 ? 64 : 128;
+    unsigned long long bit_count = (unsigned long long)count * 8;
+    for (int i = 0; i < 8; ++i) {
+        block[block_count - 1 - i] = (unsigned char)(bit_count >> (i * 8));
+    }
+
+    sha1_transform(state, block);
+    if (block_count == 128)  sha1_transform(state, block + 64);
+
+    return state[0];
+}
+
+// Loads notes which primary field matches one of 'words' by probing Anki's index on notes.csum for every word.
+// Only works when primary field is the first field of model, because Anki calculates checksum only for it.
+void load_notes_by_checksum(sqlite3* db, const LookupKey* keys, int keys_count) {
+    verify(collection_model_primary_field_index == 0);
+
+    // Checksum is only known for primary field, key fields are loaded to be looked up, but notes are not found by them.
+    char note_columns[256] { 0 };
+    format_note_columns(note_columns, ARRAYSIZE(note_columns));
+
+    char query[512] { 0 };
+    StringCchPrintfA(
+        query,
+        ARRAYSIZE(query),
+        "SELECT id, anki_field(flds, %d), anki_field(flds, %d)%s FROM notes WHERE csum = ? AND mid = %s",
+        collection_model_primary_field_index,
+        collection_model_annotation_field_index,
+        note_columns,
+        collection_model_id);
+
+    sqlite3_stmt* stmt = NULL;
+    verify(SQLITE_OK == sqlite3_prepare_v2(db, query, strlen(query)+1, &stmt, NULL));
+
+    for (int i = 0; i < keys_count; ++i) {
+        const char* key = keys[i].key;
+        const char* key_end = keys[i].key_end;
+
+        verify(SQLITE_OK == sqlite3_bind_int64(stmt, 1, anki_field_checksum(key, key_end - key)));
+
+        while (true) {
+            int status = sqlite3_step(stmt);
+            if (status == SQLITE_DONE)  break;
+            verify(status == SQLITE_ROW);
+
+            if (!sqlite3_column_text(stmt, 1))  continue;
+
+            // Different fields can have same checksum, so make sure that field actually matches after it is stripped.
+            int notes_count_before = notes_count;
+            int note_keys_count_before = note_keys_count;
+            int character_buffer_count_before = character_buffer_count;
+
+            Note* note = load_note(stmt, true);
+            if (compare_strings(note->key, note->key_end, key, key_end) != 0) {
+                notes_count = notes_count_before;
+                note_keys_count = note_keys_count_before;
+                character_buffer_count = character_buffer_count_before;
+            }
+        }
+
+        verify(SQLITE_OK == sqlite3_reset(stmt));
+    }
+
+    verify(SQLITE_OK == sqlite3_finalize(stmt));
+    stmt = NULL;
+}
+
+// Stores each distinct word in file to 'words', returns amount of stored words.
+int collect_distinct_words(LookupKey* words) {
+    int words_count = 0;
+    for (int i = 0; i < result_lines_count; ++i) {
+        const ResultLine& result_line = result_lines[i];
+        for (int j = result_line.first_span; j < result_line.last_span; ++j) {
+            const char* word = result_line.text + spans[j].offset;
+            words[words_count++] = { word, word + spans[j].length };
+        }
+    }
+
+    qsort(words, words_count, sizeof(LookupKey), compare_lookup_keys);
+
+    int distinct_count = 0;
+    for (int i = 0; i < words_count; ++i) {
+        if (distinct_count == 0 || compare_lookup_keys(&words[distinct_count - 1], &words[i]) != 0) {
+            words[distinct_count++] = words[i];
+        }
+    }
+    return distinct_count;
+}
+
+// Returns amount of notes of the model when it's at least 'threshold', otherwise a smaller number. Amount of notes in collection
+// comes from statistics gathered by ANALYZE or from index on notes.csum, and notes of model are counted only when collection
+// is big enough, since 'mid' isn't indexed and counting them reads every note (but only its 'mid').
+sqlite3_int64 estimate_model_notes_count(sqlite3* db, sqlite3_int64 threshold) {
+    char model_query[128] { 0 };
+    StringCchPrintfA(model_query, ARRAYSIZE(model_query), "SELECT COUNT(*) FROM notes WHERE mid = %s", collection_model_id);
+
+    const char* queries[] = {
+        "SELECT CAST(stat AS INTEGER) FROM sqlite_stat1 WHERE tbl = 'notes' LIMIT 1",
+        "SELECT COUNT(*) FROM notes",
+        model_query,
+    };
+
+    sqlite3_int64 count = -1;
+    for (int i = 0; i < ARRAYSIZE(queries); ++i) {
+        if (i == 1 && count >= 0)  continue;   // Collection size is known from statistics.
+        if (i == 2 && count < threshold)  break;
+
+        sqlite3_stmt* stmt = NULL;
+        if (SQLITE_OK != sqlite3_prepare_v2(db, queries[i], strlen(queries[i])+1, &stmt, NULL)) {
+            continue;  // sqlite_stat1 doesn't exist if ANALYZE was never run.
+        }
+
+        if (sqlite3_step(stmt) == SQLITE_ROW)  count = sqlite3_column_int64(stmt, 0);
+
+        verify(SQLITE_OK == sqlite3_finalize(stmt));
+        stmt = NULL;
+    }
+
+    verify(count >= 0);
+    return count;
+}
+
+// Dictionary is Aho-Corasick automaton over UTF-8 bytes of note keys, it finds all keys in line in one pass.
+// Without failure links it is a trie of keys, which find_prefix_key() uses to find the longest key that starts word.
+// Transitions are stored in double array: transition from state S by byte C goes to state T = base(S) + C if check(T) == S,
+// so each transition takes one lookup and automaton takes a few bytes per state.
+struct DictionaryState {
+    int base;     // Transitions of this state start at this slot.
+    int check;    // State which transition leads to this slot, -1 if slot is free.
+    int failure;  // State for the longest proper suffix of this state's text that is in automaton.
+    int output;   // Nearest state on failure chain that ends a key, -1 if there is none.
+    int key;      // Index of first key in 'note_keys' that ends in this state, -1 if no key ends here.
+    int depth;    // Length of this state's text in bytes.
+};
+DictionaryState dictionary_empty_root = { 0, 0, 0, -1, -1, 0 };  // Dictionary without keys, used until it's built or when it can't be built.
+DictionaryState* dictionary_states = &dictionary_empty_root;
+int dictionary_capacity = 1;       // Slots of double array, it grows while dictionary is built.
+int dictionary_states_count = 1;   // All states are below this slot.
+
+// Free slots form a list while dictionary is built, so search for base skips taken slots. Search starts at cursor, the head of list,
+// and slots that failed to take first label of state MAX_DICTIONARY_BASE_TRIES times leave the list (they stay free for other labels),
+// so build doesn't rescan the same crowded slots for every state. List ends at slot 'dictionary_capacity', which doesn't exist yet.
+enum { MAX_DICTIONARY_BASE_TRIES = 16 };
+int* dictionary_next_free = NULL;       // -1 for slots that are not in list.
+int* dictionary_previous_free = NULL;   // -1 for cursor.
+unsigned char* dictionary_base_tries = NULL;
+int dictionary_free_cursor = 0;
+
+// Keys are compared ignoring ASCII case, like compare_strings() does.
+inline unsigned char fold_dictionary_byte(char c) {
+    return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : (unsigned char)c;
+}
+
+inline int dictionary_transition(int state, unsigned char c) {
+    int next = dictionary_states[state].base + c;
+    return next < dictionary_capacity && dictionary_states[next].check == state ? next : -1;
+}
+
+// Moves automaton by byte of text, following failure links until there is a transition.
+inline int next_dictionary_state(int state, unsigned char c) {
+    while (true) {
+        int next = dictionary_transition(state, c);
+        if (next != -1)  return next;
+        if (state == 0)  return 0;
+        state = dictionary_states[state].failure;
+    }
+}
+
+// Returns first state that ends a key among state and states on its output chain, or -1.
+inline int first_dictionary_match(int state) {
+    return dictionary_states[state].key != -1 ? state : dictionary_states[state].output;
+}
+
+// Grows double array to at least 'count' slots, new slots are free and are added to the end of free list.
+// Returns false if dictionary would need more than MAX_DICTIONARY_STATES slots or memory can't be allocated.
+bool reserve_dictionary(int count) {
+    if (count <= dictionary_capacity)  return true;
+    if (count > MAX_DICTIONARY_STATES)  return false;
+
+    int old_capacity = dictionary_capacity;
+    int capacity = min(max(count, max(0x1000, old_capacity * 2)), (int)MAX_DICTIONARY_STATES);
+
+    auto states = (DictionaryState*)realloc(dictionary_states, capacity * sizeof(DictionaryState));
+    if (!states)  return false;
+    dictionary_states = states;
+
+    // Free list arrays have one more slot for end of list.
+    auto next_free = (int*)realloc(dictionary_next_free, (capacity + 1) * sizeof(int));
+    if (next_free)  dictionary_next_free = next_free;
+    auto previous_free = (int*)realloc(dictionary_previous_free, (capacity + 1) * sizeof(int));
+    if (previous_free)  dictionary_previous_free = previous_free;
+    auto base_tries = (unsigned char*)realloc(dictionary_base_tries, capacity);
+    if (base_tries)  dictionary_base_tries = base_tries;
+    if (!next_free || !previous_free || !base_tries)  return false;
+
+    int last_free = old_capacity == 0 ? -1 : dictionary_previous_free[old_capacity];
+    for (int i = old_capacity; i < capacity; ++i) {
+        dictionary_states[i] = { 0, -1, 0, -1, -1, 0 };
+        dictionary_next_free[i] = i + 1;
+        dictionary_previous_free[i] = i - 1;
+        dictionary_base_tries[i] = 0;
+    }
+    dictionary_previous_free[old_capacity] = last_free;
+    dictionary_previous_free[capacity] = capacity - 1;
+    dictionary_capacity = capacity;
+    return true;
+}
+
+// Removes slot from free list, if it's still there.
+void unlink_dictionary_slot(int slot) {
+    int next = dictionary_next_free[slot];
+    int previous = dictionary_previous_free[slot];
+    if (next == -1)  return;
+
+    if (previous == -1) {
+        dictionary_free_cursor = next;
+    } else {
+        dictionary_next_free[previous] = next;
+    }
+    dictionary_previous_free[next] = previous;
+    dictionary_next_free[slot] = -1;
+}
+
+// Finds base for state which transitions are taken by sorted 'labels', so all target slots are free, and grows double array to fit them.
+// Only bases that put first label into a free slot are tried. Returns -1 if double array can't grow.
+int find_dictionary_base(const unsigned char* labels, int labels_count) {
+    for (int slot = dictionary_free_cursor; ; ) {
+        int base = max(slot - labels[0], 1);
+        if (!reserve_dictionary(base + labels[labels_count - 1] + 1))  return -1;
+
+        bool fits = true;
+        for (int i = 0; i < labels_count && fits; ++i) {
+            fits = dictionary_states[base + labels[i]].check == -1;
+        }
+        if (fits)  return base;
+
+        // Slot at the end of list didn't exist before array grew, so labels always fit there.
+        assert(slot < dictionary_capacity);
+        int next = dictionary_next_free[slot];
+        if (++dictionary_base_tries[slot] >= MAX_DICTIONARY_BASE_TRIES)  unlink_dictionary_slot(slot);
+        slot = next;
+    }
+}
+
+// Part of sorted 'note_keys' with keys that start with text of state.
+struct DictionaryQueueEntry {
+    int state;
+    int first_key;
+    int last_key;  // Exclusive.
+};
+
+// Frees double array of dictionary and leaves dictionary without keys.
+void free_dictionary() {
+    if (dictionary_states != &dictionary_empty_root)  free(dictionary_states);
+    free(dictionary_next_free);
+    free(dictionary_previous_free);
+    free(dictionary_base_tries);
+    dictionary_states = &dictionary_empty_root;
+    dictionary_next_free = NULL;
+    dictionary_previous_free = NULL;
+    dictionary_base_tries = NULL;
+    dictionary_capacity = 1;
+    dictionary_states_count = 1;
+}
+
+// Builds dictionary from sorted 'note_keys'. Trie is built breadth-first: keys that share the prefix of state are
+// a contiguous range, so children of state are groups of this range by next byte. Failure links are set right after children
+// are placed, because failure states are not deeper than their parents and their transitions are placed already.
+// Returns false and leaves dictionary without keys if it needs more than MAX_DICTIONARY_STATES states or memory can't be allocated.
+bool build_dictionary() {
+    // Each byte of keys adds at most one state.
+    int keys_size = 1;
+    for (int i = 0; i < note_keys_count; ++i)  keys_size += (int)(note_keys[i].key_end - note_keys[i].key);
+
+    auto queue = (DictionaryQueueEntry*)malloc(keys_size * sizeof(DictionaryQueueEntry));
+    if (!queue)  return false;
+    int queue_start = 0;
+    int queue_end = 0;
+
+    // Slot 0 is root state.
+    free_dictionary();
+    dictionary_states = NULL;
+    dictionary_capacity = 0;
+    dictionary_free_cursor = 0;
+    bool built = reserve_dictionary(1);
+    if (built) {
+        unlink_dictionary_slot(0);
+        dictionary_states[0].check = 0;
+        queue[queue_end++] = { 0, 0, note_keys_count };
+    }
+
+    while (queue_start < queue_end) {
+        DictionaryQueueEntry entry = queue[queue_start++];
+        DictionaryState* state = &dictionary_states[entry.state];
+        int depth = state->depth;
+
+        // Shorter keys are sorted first, so keys that end in this state are at the start of range.
+        int key_index = entry.first_key;
+        while (key_index < entry.last_key && note_keys[key_index].key_end - note_keys[key_index].key == depth)  ++key_index;
+
+        unsigned char labels[256];
+        int label_first_keys[257];
+        int labels_count = 0;
+        for (; key_index < entry.last_key; ++key_index) {
+            unsigned char label = fold_dictionary_byte(note_keys[key_index].key[depth]);
+            if (labels_count == 0 || labels[labels_count - 1] != label) {
+                labels[labels_count] = label;
+                label_first_keys[labels_count] = key_index;
+                ++labels_count;
+            }
+        }
+        label_first_keys[labels_count] = entry.last_key;
+        if (labels_count == 0)  continue;
+
+        // Double array may move while base is found.
+        int base = find_dictionary_base(labels, labels_count);
+        if (base == -1) {
+            built = false;
+            break;
+        }
+        state = &dictionary_states[entry.state];
+        state->base = base;
+        for (int i = 0; i < labels_count; ++i) {
+            int child_index = state->base + labels[i];
+            DictionaryState* child = &dictionary_states[child_index];
+            child->check = entry.state;
+            unlink_dictionary_slot(child_index);
+            child->depth = depth + 1;
+
+            // Key is set before state is visited, because output links of states on this level may point to it.
+            const NoteKey* first_key = &note_keys[label_first_keys[i]];
+            if (first_key->key_end - first_key->key == depth + 1)  child->key = label_first_keys[i];
+            dictionary_states_count = max(dictionary_states_count, child_index + 1);
+
+            assert(queue_end < keys_size);
+            queue[queue_end++] = { child_index, label_first_keys[i], label_first_keys[i + 1] };
+        }
+
+        for (int i = 0; i < labels_count; ++i) {
+            DictionaryState* child = &dictionary_states[state->base + labels[i]];
+            child->failure = 0;
+            if (entry.state != 0) {
+                int failure = state->failure;
+                while (true) {
+                    int next = dictionary_transition(failure, labels[i]);
+                    if (next != -1) {
+                        child->failure = next;
+                        break;
+                    }
+                    if (failure == 0)  break;
+                    failure = dictionary_states[failure].failure;
+                }
+            }
+
+            DictionaryState* failure = &dictionary_states[child->failure];
+            child->output = failure->key != -1 ? child->failure : failure->output;
+        }
+    }
+    free(queue);
+
+    // Free list is needed only while dictionary is built.
+    free(dictionary_next_free);
+    free(dictionary_previous_free);
+    free(dictionary_base_tries);
+    dictionary_next_free = NULL;
+    dictionary_previous_free = NULL;
+    dictionary_base_tries = NULL;
+
+    if (!built)  free_dictionary();
+    return built;
+}
+
+// Finds leftmost key in text, the longest one if several keys start there. Returns index of key in 'note_keys' or -1.
+int find_dictionary_word(const char* text, const char* text_end, const char** word, const char** word_end) {
+    const char* best_start = NULL;
+    int best_depth = 0;
+    int best_key = -1;
+
+    int state = 0;
+    for (const char* now = text; now < text_end; ++now) {
+        state = next_dictionary_state(state, fold_dictionary_byte(*now));
+
+        // Keys that end here are this state and states on its output chain.
+        for (int match = first_dictionary_match(state); match != -1; match = dictionary_states[match].output) {
+            const DictionaryState* match_state = &dictionary_states[match];
+            const char* start = now + 1 - match_state->depth;
+            if (!best_start || start < best_start || (start == best_start && match_state->depth > best_depth)) {
+                best_start = start;
+                best_depth = match_state->depth;
+                best_key = match_state->key;
+            }
+        }
+
+        // Keys found later start after text of current state, so they can't be to the left of found one.
+        if (best_start && best_start < now + 1 - dictionary_states[state].depth)  break;
+    }
+
+    if (!best_start)  return -1;
+    *word = best_start;
+    *word_end = best_start + best_depth;
+    return best_key;
+}
+
+// Finds the longest key that 'word' starts with by following transitions of dictionary over bytes of word once.
+// Returns -1 if word doesn't start with any key.
+int find_prefix_key(const char* word, const char* word_end, const char** prefix_end) {
+    int best_state = -1;
+
+    int state = 0;
+    for (const char* now = word; now < word_end; ++now) {
+        state = dictionary_transition(state, fold_dictionary_byte(*now));
+        if (state == -1)  break;
+        if (dictionary_states[state].key != -1)  best_state = state;
+    }
+
+    if (best_state == -1)  return -1;
+    *prefix_end = word + dictionary_states[best_state].depth;
+    return dictionary_states[best_state].key;
+}
+
+// Word of segmentation path, offsets are in bytes from start of text.
+struct SegmentWord {
+    int start;
+    int end;
+    int key;   // Index in 'note_keys', -1 if it's a character that is not part of any key.
+};
+
+// Lattice has a node for every byte offset of text, node keeps cost of the best path from start of text to it and last word of that path.
+// Arena only grows, so segmentation of lines doesn't allocate memory once it fits the longest line.
+struct LatticeArena {
+    int capacity = 0;            // Amount of nodes that arrays can hold.
+    int* costs = NULL;
+    SegmentWord* last_words = NULL;
+    SegmentWord* path = NULL;    // Words of best path through whole text, set by segment_text().
+};
+static LatticeArena lattice_arena;
+
+void reserve_lattice(LatticeArena* arena, int nodes_count) {
+    if (nodes_count <= arena->capacity)  return;
+
+    int capacity = max(nodes_count, arena->capacity * 2);
+    arena->costs = (int*)realloc(arena->costs, capacity * sizeof(int));
+    arena->last_words = (SegmentWord*)realloc(arena->last_words, capacity * sizeof(SegmentWord));
+    arena->path = (SegmentWord*)realloc(arena->path, capacity * sizeof(SegmentWord));
+    verify(arena->costs && arena->last_words && arena->path);
+    arena->capacity = capacity;
+}
+
+int segmentation_cost(const NoteKey* note_key) {
+    int cost = segmentation_word_cost + note_key->priority * segmentation_key_field_cost;
+    bool kana_only = true;
+
+    char* now = note_key->key;
+    while (now < note_key->key_end) {
+        int codepoint = read_utf8_codepoint(&now, note_key->key_end - now);
+        cost += segmentation_character_cost;
+        kana_only = kana_only && is_kana_codepoint(codepoint);
+    }
+
+    return kana_only ? cost + segmentation_kana_word_cost : cost;
+}
+
+// Splits run of text in range [run_start, run_end) into known words and unknown characters by path with the lowest cost (Viterbi).
+// Keys found by dictionary are edges of lattice, and since all keys that end at offset are found when automaton reaches it,
+// and they start earlier, best path to each node is known in the same pass. Stores words to 'path', returns their amount.
+int segment_run(LatticeArena* arena, const char* text, int run_start, int run_end, SegmentWord* path) {
+    int* costs = arena->costs;
+    SegmentWord* last_words = arena->last_words;
+    costs[run_start] = 0;
+
+    int state = 0;
+    int character_start = run_start;
+    for (int i = run_start; i < run_end; ++i) {
+        state = next_dictionary_state(state, fold_dictionary_byte(text[i]));
+
+        // Keys are whole characters, so nodes inside of characters are not reachable.
+        int end = i + 1;
+        if (end < run_end && ((unsigned char)text[end] & 0xC0) == 0x80)  continue;
+
+        costs[end] = costs[character_start] + segmentation_unknown_character_cost;
+        last_words[end] = { character_start, end, -1 };
+
+        for (int match = first_dictionary_match(state); match != -1; match = dictionary_states[match].output) {
+            const DictionaryState* match_state = &dictionary_states[match];
+            int start = end - match_state->depth;
+            const NoteKey* note_key = &note_keys[match_state->key];
+            int cost = costs[start] + segmentation_cost(note_key);
+            if (cost < costs[end]) {
+                costs[end] = cost;
+                last_words[end] = { start, end, match_state->key };
+            }
+        }
+
+        character_start = end;
+    }
+
+    int path_count = 0;
+    for (int end = run_end; end > run_start; end = last_words[end].start) {
+        path[path_count++] = last_words[end];
+    }
+    for (int i = 0; i < path_count / 2; ++i) {
+        SegmentWord word = path[i];
+        path[i] = path[path_count - 1 - i];
+        path[path_count - 1 - i] = word;
+    }
+    return path_count;
+}
+
+// Segments each run of CJK and kana characters of text by segment_run(), other characters are not words and are skipped,
+// like in first run mode. Returns amount of words of all runs in 'lattice_arena.path'.
+int segment_text(const char* text, const char* text_end) {
+    LatticeArena* arena = &lattice_arena;
+    reserve_lattice(arena, (int)(text_end - text) + 1);
+
+    int path_count = 0;
+    char* now = (char*)text;
+    while (now < text_end) {
+        char* run = now;
+        int codepoint = read_utf8_codepoint(&now, text_end - now);
+        if (codepoint == UNICODE_INVALID_CHARACTER)  now = run + 1;
+        if (!is_cjk_codepoint(codepoint) && !is_kana_codepoint(codepoint))  continue;
+
+        while (now < text_end) {
+            char* next = now;
+            codepoint = read_utf8_codepoint(&next, text_end - next);
+            if (!is_cjk_codepoint(codepoint) && !is_kana_codepoint(codepoint))  break;
+            now = next;
+        }
+
+        path_count += segment_run(arena, text, (int)(run - text), (int)(now - text), &arena->path[path_count]);
+    }
+    return path_count;
+}
+
+// Inflection index is a hash table from conjugated forms of note keys to keys, open addressing with linear probing.
+// Forms are stored in 'inflection_text' and referenced by offset, since it's reallocated as it grows.
+struct InflectionEntry {
+    unsigned int hash;
+    int text_offset;
+    int text_count;
+    int key;   // Index in 'note_keys', -1 if entry is empty.
+};
+InflectionEntry* inflection_index = NULL;
+int inflection_index_capacity = 0;  // Always a power of two.
+int inflection_index_count = 0;
+char* inflection_text = NULL;
+int inflection_text_count = 0;
+int inflection_text_capacity = 0;
+
+// FNV-1a, bytes are folded like in compare_strings().
+inline unsigned int hash_inflection(const char* text, int count) {
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < count; ++i) {
+        hash = (hash ^ fold_dictionary_byte(text[i])) * 16777619u;
+    }
+    return hash;
+}
+
+InflectionEntry* find_inflection_entry(const char* text, int count, unsigned int hash) {
+    for (int slot = hash & (inflection_index_capacity - 1); ; slot = (slot + 1) & (inflection_index_capacity - 1)) {
+        InflectionEntry* entry = &inflection_index[slot];
+        if (entry->key == -1)  return entry;
+
+        const char* entry_text = inflection_text + entry->text_offset;
+        if (entry->hash == hash && compare_strings(entry_text, entry_text + entry->text_count, text, text + count) == 0)  return entry;
+    }
+}
+
+void grow_inflection_index() {
+    InflectionEntry* old_index = inflection_index;
+    int old_capacity = inflection_index_capacity;
+
+    inflection_index_capacity = max(4096, old_capacity * 2);
+    inflection_index = (InflectionEntry*)malloc(inflection_index_capacity * sizeof(InflectionEntry));
+    verify(inflection_index);
+    for (int i = 0; i < inflection_index_capacity; ++i)  inflection_index[i].key = -1;
+
+    for (int i = 0; i < old_capacity; ++i) {
+        if (old_index[i].key == -1)  continue;
+        *find_inflection_entry(inflection_text + old_index[i].text_offset, old_index[i].text_count, old_index[i].hash) = old_index[i];
+    }
+    free(old_index);
+}
+
+// Form that is already in index keeps its key, so key that sorts first wins.
+void add_inflection(const char* text, int count, int key) {
+    if ((inflection_index_count + 1) * 2 > inflection_index_capacity)  grow_inflection_index();
+
+    unsigned int hash = hash_inflection(text, count);
+    InflectionEntry* entry = find_inflection_entry(text, count, hash);
+    if (entry->key != -1)  return;
+
+    if (inflection_text_count + count > inflection_text_capacity) {
+        inflection_text_capacity = max(inflection_text_count + count, max(0x10000, inflection_text_capacity * 2));
+        inflection_text = (char*)realloc(inflection_text, inflection_text_capacity);
+        verify(inflection_text);
+    }
+    memcpy(inflection_text + inflection_text_count, text, count);
+
+    *entry = { hash, inflection_text_count, count, key };
+    inflection_text_count += count;
+    ++inflection_index_count;
+}
+
+// Conjugates every note key by applying deinflection rules backwards up to INFLECTION_INDEX_DEPTH times, so deinflect()
+// is needed only for forms that take more rules. Note type is unknown, so all rules that fit the ending of key are applied.
+void build_inflection_index() {
+    init_deinflection_rules();
+    grow_inflection_index();
+
+    static Deinflection forms[MAX_DEINFLECTIONS];
+    static int forms_depth[MAX_DEINFLECTIONS];
+
+    for (int i = 0; i < note_keys_count; ++i) {
+        // Duplicates would give the same forms, which already point to the first of them.
+        const NoteKey* note_key = &note_keys[i];
+        if (i > 0 && compare_strings(note_keys[i - 1].key, note_keys[i - 1].key_end, note_key->key, note_key->key_end) == 0)  continue;
+
+        int key_count = (int)(note_key->key_end - note_key->key);
+        if (key_count >= MAX_DEINFLECTION_SIZE)  continue;
+
+        memcpy(forms[0].text, note_key->key, key_count);
+        forms[0].count = key_count;
+        forms[0].types = INFLECTION_DICTIONARY_FORMS;
+        forms_depth[0] = 0;
+        int forms_count = 1;
+
+        for (int j = 0; j < forms_count; ++j) {
+            if (forms_depth[j] == INFLECTION_INDEX_DEPTH)  continue;
+
+            for (int k = 0; k < deinflection_rules_count && forms_count < ARRAYSIZE(forms); ++k) {
+                const DeinflectionRule* rule = &deinflection_rules[k];
+                if (!(forms[j].types & rule->types_out))  continue;
+
+                int inflected_count = rule->inflected_count;
+                int base_count = rule->base_count;
+                if (!ends_with(forms[j].text, forms[j].count, rule->base, base_count))  continue;
+
+                int stem_count = forms[j].count - base_count;
+                if (stem_count + inflected_count >= MAX_DEINFLECTION_SIZE)  continue;
+
+                Deinflection* form = &forms[forms_count];
+                memcpy(form->text, forms[j].text, stem_count);
+                memcpy(form->text + stem_count, rule->inflected, inflected_count);
+                form->count = stem_count + inflected_count;
+                form->types = rule->types_in;
+                forms_depth[forms_count++] = forms_depth[j] + 1;
+
+                add_inflection(form->text, form->count, i);
+            }
+        }
+    }
+}
+
+int find_inflected_key(const char* word, const char* word_end) {
+    int count = (int)(word_end - word);
+    return find_inflection_entry(word, count, hash_inflection(word, count))->key;
+}
+
+// Blocked Bloom filter over all note keys: each key sets one bit in every word of one 64-byte block, so a check touches one cache line
+// and takes a few vector instructions. Bits are picked by multiplying hash by odd salts, like in split block Bloom filters of Parquet.
+enum { BLOOM_BLOCK_WORDS = 16 };
+struct BloomBlock {
+    unsigned int words[BLOOM_BLOCK_WORDS];
+};
+const unsigned int bloom_salts[BLOOM_BLOCK_WORDS] = {
+    0x47B6137Bu, 0x44974D91u, 0x8824AD5Bu, 0xA2B7289Du, 0x705495C7u, 0x2DF1424Bu, 0x9EFC4947u, 0x5C6BFB31u,
+    0x9E3779B1u, 0x85EBCA77u, 0xC2B2AE3Du, 0x27D4EB2Fu, 0x165667B1u, 0xD3A2646Bu, 0xFD7046C5u, 0xB55A4F09u,
+};
+BloomBlock* bloom_blocks = NULL;  // Aligned to cache line, NULL if filter isn't built.
+int bloom_blocks_count = 0;
+int bloom_checks_count = 0;
+int bloom_rejections_count = 0;
+int bloom_false_positives_count = 0;  // Keys that passed filter, but weren't found.
+
+// 64-bit FNV-1a, bytes are folded like in compare_strings(). High half picks block and low half picks bits in it.
+// Low bits of FNV depend only on low bits of bytes, so hash is mixed by MurmurHash3 finalizer, otherwise false positives are ~10 times more often.
+inline unsigned long long hash_bloom_key(const char* key, const char* key_end) {
+    unsigned long long hash = 14695981039346656037ull;
+    for (const char* now = key; now < key_end; ++now) {
+        hash = (hash ^ fold_dictionary_byte(*now)) * 1099511628211ull;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+inline BloomBlock* find_bloom_block(unsigned long long hash) {
+    return &bloom_blocks[((hash >> 32) * (unsigned long long)bloom_blocks_count) >> 32];
+}
+
+void build_bloom_filter() {
+    bloom_blocks_count = max(1, note_keys_count * BLOOM_BITS_PER_KEY / (BLOOM_BLOCK_WORDS * 32));
+    char* memory = (char*)calloc(bloom_blocks_count * sizeof(BloomBlock) + 63, 1);
+    verify(memory);
+    bloom_blocks = (BloomBlock*)(((size_t)memory + 63) & ~(size_t)63);
+
+    for (int i = 0; i < note_keys_count; ++i) {
+        unsigned long long hash = hash_bloom_key(note_keys[i].key, note_keys[i].key_end);
+        BloomBlock* block = find_bloom_block(hash);
+        for (int j = 0; j < BLOOM_BLOCK_WORDS; ++j) {
+            block->words[j] |= 1u << (((unsigned int)hash * bloom_salts[j]) >> 27);
+        }
+    }
+}
+
+// Returns false if no note has the key, true if some note probably has it.
+bool bloom_may_contain(const char* key, const char* key_end) {
+    unsigned long long hash = hash_bloom_key(key, key_end);
+    const BloomBlock* block = find_bloom_block(hash);
+
+#ifdef __AVX2__
+    const __m256i hash8 = _mm256_set1_epi32((int)(unsigned int)hash);
+    const __m256i one8 = _mm256_set1_epi32(1);
+    for (int i = 0; i < BLOOM_BLOCK_WORDS; i += 8) {
+        __m256i salts = _mm256_loadu_si256((const __m256i*)&bloom_salts[i]);
+        __m256i bits = _mm256_sllv_epi32(one8, _mm256_srli_epi32(_mm256_mullo_epi32(hash8, salts), 27));
+        __m256i words = _mm256_load_si256((const __m256i*)&block->words[i]);
+        if (!_mm256_testc_si256(words, bits))  return false;
+    }
+    return true;
+#else
+    for (int i = 0; i < BLOOM_BLOCK_WORDS; ++i) {
+        unsigned int bit = 1u << (((unsigned int)hash * bloom_salts[i]) >> 27);
+        if (!(block->words[i] & bit))  return false;
+    }
+    return true;
+#endif
+}
+
+// Fuzzy index is SymSpell: every key is stored under each string that it turns into after deleting up to 'fuzzy_max_distance'
+// characters, and word is looked up by its own deletions, so keys within edit distance of it are among candidates without trying
+// every insertion and replacement. Only hashes of deletions are stored, since candidates are checked by edit_distance() anyway.
+struct FuzzyEntry {
+    unsigned int hash;
+    int first_posting;  // Index in 'fuzzy_postings', -1 if entry is empty.
+};
+struct FuzzyPosting {
+    int key;   // Index in 'note_keys'.
+    int next;  // Next posting of the same entry, -1 if it's the last one.
+};
+FuzzyEntry* fuzzy_index = NULL;
+int fuzzy_index_capacity = 0;  // Always a power of two.
+int fuzzy_index_count = 0;
+FuzzyPosting* fuzzy_postings = NULL;
+int fuzzy_postings_count = 0;
+int fuzzy_postings_capacity = 0;
+int fuzzy_words_count = 0;     // Words that were found by find_fuzzy_key().
+
+enum { MAX_FUZZY_DELETIONS = 1 + MAX_FUZZY_KEY_SIZE + MAX_FUZZY_KEY_SIZE * (MAX_FUZZY_KEY_SIZE - 1) / 2 };
+
+// Decodes text into codepoints with ASCII folded like in compare_strings(). Returns amount of characters,
+// or -1 if text has more than MAX_FUZZY_KEY_SIZE of them or isn't valid UTF-8.
+int read_fuzzy_characters(const char* text, const char* text_end, int* characters) {
+    int count = 0;
+    char* now = (char*)text;
+    while (now < text_end) {
+        if (count == MAX_FUZZY_KEY_SIZE)  return -1;
+
+        int codepoint = read_utf8_codepoint(&now, text_end - now);
+        if (codepoint == UNICODE_INVALID_CHARACTER)  return -1;
+        characters[count++] = codepoint >= 'A' && codepoint <= 'Z' ? codepoint - 'A' + 'a' : codepoint;
+    }
+    return count;
+}
+
+inline int fuzzy_edits_allowed(int characters_count) {
+    return min(fuzzy_max_distance, characters_count / fuzzy_characters_per_edit);
+}
+
+// FNV-1a of characters without ones at 'skip_a' and 'skip_b' (-1 to keep all of them).
+inline unsigned int hash_fuzzy_deletion(const int* characters, int count, int skip_a, int skip_b) {
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < count; ++i) {
+        if (i == skip_a || i == skip_b)  continue;
+        hash = (hash ^ (unsigned int)characters[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Hashes of characters after deleting up to 'edits' (at most 2) of them, including characters themselves.
+int collect_fuzzy_deletions(const int* characters, int count, int edits, unsigned int* hashes) {
+    int hashes_count = 0;
+    hashes[hashes_count++] = hash_fuzzy_deletion(characters, count, -1, -1);
+    if (edits == 0)  return hashes_count;
+
+    for (int a = 0; a < count; ++a) {
+        hashes[hashes_count++] = hash_fuzzy_deletion(characters, count, a, -1);
+        if (edits == 1)  continue;
+
+        for (int b = a + 1; b < count; ++b) {
+            hashes[hashes_count++] = hash_fuzzy_deletion(characters, count, a, b);
+        }
+    }
+    return hashes_count;
+}
+
+FuzzyEntry* find_fuzzy_entry(unsigned int hash) {
+    for (int slot = hash & (fuzzy_index_capacity - 1); ; slot = (slot + 1) & (fuzzy_index_capacity - 1)) {
+        FuzzyEntry* entry = &fuzzy_index[slot];
+        if (entry->first_posting == -1 || entry->hash == hash)  return entry;
+    }
+}
+
+void grow_fuzzy_index() {
+    FuzzyEntry* old_index = fuzzy_index;
+    int old_capacity = fuzzy_index_capacity;
+
+    fuzzy_index_capacity = max(4096, old_capacity * 2);
+    fuzzy_index = (FuzzyEntry*)malloc(fuzzy_index_capacity * sizeof(FuzzyEntry));
+    verify(fuzzy_index);
+    for (int i = 0; i < fuzzy_index_capacity; ++i)  fuzzy_index[i].first_posting = -1;
+
+    for (int i = 0; i < old_capacity; ++i) {
+        if (old_index[i].first_posting == -1)  continue;
+        *find_fuzzy_entry(old_index[i].hash) = old_index[i];
+    }
+    free(old_index);
+}
+
+void add_fuzzy_deletion(unsigned int hash, int key) {
+    if ((fuzzy_index_count + 1) * 2 > fuzzy_index_capacity)  grow_fuzzy_index();
+
+    FuzzyEntry* entry = find_fuzzy_entry(hash);
+    if (entry->first_posting == -1) {
+        entry->hash = hash;
+        ++fuzzy_index_count;
+    } else if (fuzzy_postings[entry->first_posting].key == key) {
+        return;  // Deleting different characters gave the same string, e.g. either "あ" of "ああい".
+    }
+
+    if (fuzzy_postings_count == fuzzy_postings_capacity) {
+        fuzzy_postings_capacity = max(0x1000, fuzzy_postings_capacity * 2);
+        fuzzy_postings = (FuzzyPosting*)realloc(fuzzy_postings, fuzzy_postings_capacity * sizeof(FuzzyPosting));
+        verify(fuzzy_postings);
+    }
+    fuzzy_postings[fuzzy_postings_count] = { key, entry->first_posting };
+    entry->first_posting = fuzzy_postings_count++;
+}
+
+void build_fuzzy_index() {
+    verify(fuzzy_max_distance <= 2);
+    grow_fuzzy_index();
+
+    static unsigned int hashes[MAX_FUZZY_DELETIONS];
+    int characters[MAX_FUZZY_KEY_SIZE];
+
+    for (int i = 0; i < note_keys_count; ++i) {
+        // Duplicates would be candidates for the same words as the first of them.
+        const NoteKey* note_key = &note_keys[i];
+        if (i > 0 && compare_strings(note_keys[i - 1].key, note_keys[i - 1].key_end, note_key->key, note_key->key_end) == 0)  continue;
+
+        int count = read_fuzzy_characters(note_key->key, note_key->key_end, characters);
+        if (count < 0)  continue;
+
+        int edits = fuzzy_edits_allowed(count);
+        if (edits == 0)  continue;
+
+        int hashes_count = collect_fuzzy_deletions(characters, count, edits, hashes);
+        for (int j = 0; j < hashes_count; ++j) {
+            add_fuzzy_deletion(hashes[j], i);
+        }
+    }
+}
+
+// Levenshtein distance between strings of characters. Returns 'limit' + 1 as soon as it's known to be above 'limit'.
+int edit_distance(const int* a, int a_count, const int* b, int b_count, int limit) {
+    if (abs(a_count - b_count) > limit)  return limit + 1;
+
+    int row[MAX_FUZZY_KEY_SIZE + 1];
+    for (int j = 0; j <= b_count; ++j)  row[j] = j;
+
+    for (int i = 1; i <= a_count; ++i) {
+        int diagonal = row[0];
+        row[0] = i;
+        int row_min = row[0];
+        for (int j = 1; j <= b_count; ++j) {
+            int above = row[j];
+            row[j] = min(min(above, row[j - 1]) + 1, diagonal + (a[i - 1] != b[j - 1] ? 1 : 0));
+            diagonal = above;
+            row_min = min(row_min, row[j]);
+        }
+        if (row_min > limit)  return limit + 1;
+    }
+    return min(row[b_count], limit + 1);
+}
+
+// Finds key within allowed edit distance of word: the closest one, then the one with the best priority, then the one that sorts first.
+// Returns -1 if there is none. Both word and key allow edits by their amount of characters, so the shorter one limits the distance.
+int find_fuzzy_key(const char* word, const char* word_end) {
+    static unsigned int hashes[MAX_FUZZY_DELETIONS];
+    int characters[MAX_FUZZY_KEY_SIZE];
+    int key_characters[MAX_FUZZY_KEY_SIZE];
+
+    int count = read_fuzzy_characters(word, word_end, characters);
+    if (count < 0)  return -1;
+
+    int edits = fuzzy_edits_allowed(count);
+    if (edits == 0)  return -1;
+
+    int best_key = -1;
+    int best_distance = edits + 1;
+    int hashes_count = collect_fuzzy_deletions(characters, count, edits, hashes);
+    for (int i = 0; i < hashes_count; ++i) {
+        const FuzzyEntry* entry = find_fuzzy_entry(hashes[i]);
+        for (int posting = entry->first_posting; posting != -1; posting = fuzzy_postings[posting].next) {
+            int key = fuzzy_postings[posting].key;
+            if (key == best_key)  continue;
+
+            const NoteKey* note_key = &note_keys[key];
+            int key_count = read_fuzzy_characters(note_key->key, note_key->key_end, key_characters);
+            int limit = min(edits, fuzzy_edits_allowed(key_count));
+            int distance = edit_distance(characters, count, key_characters, key_count, limit);
+            if (distance > limit)  continue;
+
+            bool better = best_key == -1 || distance < best_distance ||
+                          (distance == best_distance && (note_key->priority < note_keys[best_key].priority ||
+                                                         (note_key->priority == note_keys[best_key].priority && key < best_key)));
+            if (better) {
+                best_key = key;
+                best_distance = distance;
+            }
+        }
+    }
+    return best_key;
+}
+
+void build_note_cache(sqlite3* db) {
+    static LookupKey words[MAX_SPANS];
+    int words_count = 0;
+
+    // In dictionary mode words are not known until all notes are loaded, and inflection and fuzzy indexes are built from all notes.
+    bool needs_all_notes = word_mode != WORD_MODE_FIRST_RUN || precompute_inflections || fuzzy_max_distance > 0;
+    NoteLookupStrategy strategy = needs_all_notes ? NOTE_LOOKUP_FULL_SCAN : note_lookup_strategy;
+    if (strategy != NOTE_LOOKUP_FULL_SCAN) {
+        LARGE_INTEGER tick_start = get_tick();
+
+        words_count = collect_distinct_words(words);
+        if (strategy == NOTE_LOOKUP_AUTOMATIC) {
+            // Checksum lookup reads only notes of words. Targeted lookup reads all notes like full scan does, but keeps only matching ones,
+            // which pays off when most notes would be loaded for nothing.
+            bool can_use_checksum = collection_model_primary_field_index == 0 && !fold_kana && !collection_model_has_key_fields();
+            sqlite3_int64 checksum_threshold = (sqlite3_int64)words_count * checksum_lookup_notes_per_word;
+            sqlite3_int64 targeted_threshold = min((sqlite3_int64)words_count * targeted_lookup_notes_per_word, (sqlite3_int64)MAX_NOTES + 1);
+
+            // Model is counted exactly only when collection reaches the lower threshold.
+            sqlite3_int64 notes_estimate = estimate_model_notes_count(db, can_use_checksum ? min(checksum_threshold, targeted_threshold) : targeted_threshold);
+            if (can_use_checksum && notes_estimate >= checksum_threshold) {
+                strategy = NOTE_LOOKUP_CHECKSUM;
+            } else if (notes_estimate >= targeted_threshold) {
+                strategy = NOTE_LOOKUP_TARGETED;
+            } else {
+                strategy = NOTE_LOOKUP_FULL_SCAN;
+            }
+
+            log_message("Planning: %d distinct words, ~%lld notes to scan%s (%lf seconds)\n", words_count, notes_estimate,
+                        can_use_checksum ? "" : ", model can't be looked up by checksum", seconds_since(tick_start));
+        }
+    }
+
+    const char* strategy_name = NULL;
+    LARGE_INTEGER tick_start = get_tick();
+    LookupKey* keys = NULL;
+    switch (strategy) {
+        case NOTE_LOOKUP_TARGETED: {
+            strategy_name = "targeted lookup";
+            int keys_count = collect_lookup_keys(words, words_count, &keys);
+            load_matching_notes(db, keys, keys_count);
+            break;
+        }
+        case NOTE_LOOKUP_CHECKSUM: {
+            strategy_name = "checksum lookup";
+            int keys_count = collect_lookup_keys(words, words_count, &keys);
+            load_notes_by_checksum(db, keys, keys_count);
+            break;
+        }
+        default: {
+            strategy_name = "full scan";
+            load_all_notes(db);
+            break;
+        }
+    }
+    free(keys);
+    qsort(note_keys, note_keys_count, sizeof(NoteKey), compare_note_keys);
+    group_note_keys();
+
+    log_message("Loading notes: %s, %d notes with %d keys loaded (%lf seconds)\n", strategy_name, notes_count, note_keys_count, seconds_since(tick_start));
+
+    if (precompute_inflections) {
+        tick_start = get_tick();
+        build_inflection_index();
+        log_message("Building inflection index: %d forms (%lf seconds)\n", inflection_index_count, seconds_since(tick_start));
+    }
+
+    if (word_mode != WORD_MODE_FIRST_RUN || prefix_fallback) {
+        tick_start = get_tick();
+        if (build_dictionary()) {
+            log_message("Building dictionary: %d states (%lf seconds)\n", dictionary_states_count, seconds_since(tick_start));
+        } else {
+            log_message("Building dictionary: keys need more than %d states, words won't be found by dictionary\n", (int)MAX_DICTIONARY_STATES);
+        }
+    }
+
+    // Other modes find words by dictionary, so only first run mode looks keys up one by one.
+    if (word_mode == WORD_MODE_FIRST_RUN && bloom_filter) {
+        tick_start = get_tick();
+        build_bloom_filter();
+        log_message("Building Bloom filter: %d blocks, %u KB (%lf seconds)\n",
+                    bloom_blocks_count, (unsigned int)(bloom_blocks_count * sizeof(BloomBlock) / 1024), seconds_since(tick_start));
+    }
+
+    if (word_mode == WORD_MODE_FIRST_RUN && fuzzy_max_distance > 0) {
+        tick_start = get_tick();
+        build_fuzzy_index();
+        size_t fuzzy_index_size = fuzzy_index_capacity * sizeof(FuzzyEntry) + fuzzy_postings_capacity * sizeof(FuzzyPosting);
+        log_message("Building fuzzy index: %d deletions with %d postings, %u KB (%lf seconds)\n",
+                    fuzzy_index_count, fuzzy_postings_count, (unsigned int)(fuzzy_index_size / 1024), seconds_since(tick_start));
+    }
+}
+
+// Returns index of the preferred one among equal keys in 'note_keys', its duplicates follow it. Returns -1 if no note has the key.
+int find_note_key(const char* key, const char* key_end) {
+    if (bloom_blocks) {
+        ++bloom_checks_count;
+        if (!bloom_may_contain(key, key_end)) {
+            ++bloom_rejections_count;
+            return -1;
+        }
+    }
+
+    int first = 0;
+    int last = note_keys_count;
+    while (first < last) {
+        int middle = first + (last - first) / 2;
+        if (compare_strings(note_keys[middle].key, note_keys[middle].key_end, key, key_end) < 0) {
+            first = middle + 1;
+        } else {
+            last = middle;
+        }
+    }
+
+    if (first == note_keys_count || compare_strings(note_keys[first].key, note_keys[first].key_end, key, key_end) != 0) {
+        if (bloom_blocks)  ++bloom_false_positives_count;
+        return -1;
+    }
+    return first;
+}
+
+// Finds key for dictionary form of conjugated word, first in inflection index, then by deinflection rules.
+int find_dictionary_form_key(const char* word, const char* word_end) {
+    static Deinflection forms[MAX_DEINFLECTIONS];
+
+    if (precompute_inflections) {
+        int key = find_inflected_key(word, word_end);
+        if (key != -1)  return key;
+    }
+
+    if (deinflect_words) {
+        int forms_count = deinflect(word, word_end, forms, ARRAYSIZE(forms));
+        for (int i = 1; i < forms_count; ++i) {
+            if (!(forms[i].types & INFLECTION_DICTIONARY_FORMS))  continue;
+
+            int key = find_note_key(forms[i].text, forms[i].text + forms[i].count);
+            if (key != -1)  return key;
+        }
+    }
+    return -1;
+}
+
+// Finds note for each word of first run mode, or finds words with notes in dictionary and segmentation modes.
+// Done for every line once, so writers and sort_lines() don't have to.
+void resolve_result_lines() {
+    for (int i = 0; i < result_lines_count; ++i) {
+        auto& result_line = result_lines[i];
+        char* text = result_line.text;
+        char* text_end = result_line.text_end;
+
+        if (word_mode == WORD_MODE_DICTIONARY) {
+            result_line.first_span = spans_count;
+
+            const char* now = text;
+            const char* word = NULL;
+            const char* word_end = NULL;
+            int key = -1;
+            while ((key = find_dictionary_word(now, text_end, &word, &word_end)) != -1) {
+                add_span((int)(word - text), (int)(word_end - word), key);
+                if (!annotate_every_word)  break;
+                now = word_end;
+            }
+
+            result_line.last_span = spans_count;
+        } else if (word_mode == WORD_MODE_SEGMENTATION) {
+            result_line.first_span = spans_count;
+
+            int path_count = segment_text(text, text_end);
+            for (int j = 0; j < path_count; ++j) {
+                const SegmentWord& segment_word = lattice_arena.path[j];
+                if (segment_word.key == -1)  continue;
+
+                add_span(segment_word.start, segment_word.end - segment_word.start, segment_word.key);
+                if (!annotate_every_word)  break;
+            }
+
+            result_line.last_span = spans_count;
+        } else {
+            for (int j = result_line.first_span; j < result_line.last_span; ++j) {
+                Span* span = &spans[j];
+                const char* word = text + span->offset;
+                const char* word_end = word + span->length;
+
+                int key = find_note_key(word, word_end);
+                if (key == -1)  key = find_dictionary_form_key(word, word_end);
+                if (key == -1 && prefix_fallback) {
+                    // Word is cut to found key, e.g. "日本語で" becomes "日本語".
+                    const char* prefix_end = NULL;
+                    key = find_prefix_key(word, word_end, &prefix_end);
+                    if (key != -1)  span->length = (int)(prefix_end - word);
+                }
+                if (key == -1 && fuzzy_max_distance > 0) {
+                    key = find_fuzzy_key(word, word_end);
+                    span->fuzzy = key != -1;
+                    if (span->fuzzy)  ++fuzzy_words_count;
+                }
+                span->key = key;
+            }
+        }
+
+        for (int j = result_line.first_span; j < result_line.last_span && !result_line.note; ++j) {
+            if (spans[j].key != -1)  result_line.note = &notes[note_keys[spans[j].key].note];
+        }
+    }
+}
+
+int __cdecl compare_note_pointers_by_id(void const* aa, void const* bb) {
+    Note* a = *(Note**)aa;
+    Note* b = *(Note**)bb;
+
+    return a->id < b->id ? -1 : (a->id > b->id ? 1 : 0);
+}
+
+// Loads annotation fields for notes that were found by resolve_result_lines(). Used when lazy_annotation_loading is enabled.
+void load_note_annotations(sqlite3* db) {
+    static Note* matched_notes[MAX_SPANS];
+    int matched_notes_count = 0;
+
+    for (int i = 0; i < spans_count; ++i) {
+        if (spans[i].key == -1)  continue;
+
+        for (int key = spans[i].key; key < duplicate_keys_end(spans[i].key); ++key) {
+            Note* note = &notes[note_keys[key].note];
+            if (!note->annotate) {
+                verify(matched_notes_count < ARRAYSIZE(matched_notes));
+                matched_notes[matched_notes_count++] = note;
+            }
+        }
+    }
+
+    qsort(matched_notes, matched_notes_count, sizeof(Note*), compare_note_pointers_by_id);
+
+    // Same note could be found in multiple words.
+    int unique_count = 0;
+    for (int i = 0; i < matched_notes_count; ++i) {
+        if (unique_count == 0 || matched_notes[unique_count - 1] != matched_notes[i]) {
+            matched_notes[unique_count++] = matched_notes[i];
+        }
+    }
+    matched_notes_count = unique_count;
+
+    for (int batch_start = 0; batch_start < matched_notes_count; batch_start += ANNOTATION_BATCH_SIZE) {
+        int batch_count = min(ANNOTATION_BATCH_SIZE, matched_notes_count - batch_start);
+
+        char query[128 + ANNOTATION_BATCH_SIZE * 2] { 0 };
+        StringCchPrintfA(query, ARRAYSIZE(query), "SELECT id, anki_field(flds, %d) FROM notes WHERE id IN (?", collection_model_annotation_field_index);
+        for (int i = 1; i < batch_count; ++i) {
+            StringCchCatA(query, ARRAYSIZE(query), ",?");
+        }
+        StringCchCatA(query, ARRAYSIZE(query), ")");
+
+        sqlite3_stmt* stmt = NULL;
+        verify(SQLITE_OK == sqlite3_prepare_v2(db, query, strlen(query)+1, &stmt, NULL));
+
+        for (int i = 0; i < batch_count; ++i) {
+            verify(SQLITE_OK == sqlite3_bind_int64(stmt, i + 1, matched_notes[batch_start + i]->id));
+        }
+
+        while (true) {
+            int status = sqlite3_step(stmt);
+            if (status == SQLITE_DONE)  break;
+            verify(status == SQLITE_ROW);
+
+            Note placeholder;
+            placeholder.id = sqlite3_column_int64(stmt, 0);
+            Note* key = &placeholder;
+            Note** found = (Note**)bsearch(&key, &matched_notes[batch_start], batch_count, sizeof(Note*), compare_note_pointers_by_id);
+            verify(found);
+
+            const char* annotate = (const char*)sqlite3_column_text(stmt, 1);
+            int annotate_size = sqlite3_column_bytes(stmt, 1);
+            verify(annotate);  // Note doesn't have annotation field.
+
+            Note* note = *found;
+            note->annotate = copy_field(annotate, annotate_size, strip_annotation_html, &note->annotate_end);
+        }
+
+        verify(SQLITE_OK == sqlite3_finalize(stmt));
+        stmt = NULL;
+    }
+
+    for (int i = 0; i < matched_notes_count; ++i) {
+        verify(matched_notes[i]->annotate);  // Note was deleted from collection while we were working.
+    }
+}
+
+// Checks whether note is annotation of one of words of line before 'span', or of one of keys of 'span' before 'key'.
+bool is_line_note_written(const ResultLine& result_line, int span, int key, int note_index) {
+    for (int i = result_line.first_span; i <= span; ++i) {
+        if (spans[i].key == -1)  continue;
+
+        int keys_end = i == span ? key : duplicate_keys_end(spans[i].key);
+        for (int j = spans[i].key; j < keys_end; ++j) {
+            if (note_keys[j].note == note_index)  return true;
+        }
+    }
+    return false;
+}
+
+// Writes annotations of all words of line that have notes, each note once, separated by 'separator'.
+void write_line_annotations(HANDLE annotated_file, const ResultLine& result_line, const char* separator) {
+    bool first = true;
+    for (int i = result_line.first_span; i < result_line.last_span; ++i) {
+        if (spans[i].key == -1)  continue;
+
+        for (int key = spans[i].key; key < duplicate_keys_end(spans[i].key); ++key) {
+            int note_index = note_keys[key].note;
+            if (is_line_note_written(result_line, i, key, note_index))  continue;
+
+            if (!first)  write_to_file(annotated_file, separator, strlen(separator));
+            first = false;
+
+            if (spans[i].fuzzy) {
+                write_to_file(annotated_file, fuzzy_marker, strlen(fuzzy_marker));
+                write_to_file(annotated_file, " ", 1);
+            }
+
+            const Note* note = &notes[note_index];
+            write_to_file(annotated_file, note->annotate, note->annotate_end - note->annotate);
+        }
+    }
+}
+
+// All lines with annotations.
+void write_annotations_v1(HANDLE annotated_file) {
+    int can_apply = 0;
+    for (int i = 0; i < result_lines_count; ++i) {
+        auto& result_line = result_lines[i];
+        if (result_line.note != NULL) {
+            can_apply++;
+
+            write_line_annotations(annotated_file, result_line, "");
+            write_to_file(annotated_file, result_line.line, result_line.line_end - result_line.line);
+            continue;
+        }
+
+        // Line doesn't contain a word to annotate or word wasn't found in database.
+        // @TODO: Batch lines without words and write them as one chunk.
+        write_to_file(annotated_file, result_line.line, result_line.line_end - result_line.line);
+    }
+}
+
+// Only lines with annonations.
+void write_annotations_v2(HANDLE annotated_file) {
+    int can_apply = 0;
+    for (int i = 0; i < result_lines_count; ++i) {
+        auto& result_line = result_lines[i];
+        if (result_line.note != NULL) {
+            can_apply++;
+
+            write_line_annotations(annotated_file, result_line, "");
+            write_to_file(annotated_file, result_line.line, result_line.line_end - result_line.line);
+            continue;
+        }
+    }
+}
+
+// Only lines with annonations + trim spaces
+void write_annotations_v3(HANDLE annotated_file) {
+    int can_apply = 0;
+    for (int i = 0; i < result_lines_count; ++i) {
+        auto& result_line = result_lines[i];
+        if (result_line.note != NULL) {
+            can_apply++;
+
+            write_line_annotations(annotated_file, result_line, " ");
+
+            char* trim_line = result_line.line;
+            while (true) {
+                char* now = trim_line;
+                int codepoint = read_utf8_codepoint(&now, result_line.line_end - now);
+                assert(codepoint != UNICODE_INVALID_CHARACTER);
+                if (codepoint == 0)  break;
+                if (is_space_codepoint(codepoint)) {
+                    trim_line = now;
+                } else {
+                    break;
+                }
+            }
+
+            write_to_file(annotated_file, " ", 1);
+            write_to_file(annotated_file, trim_line, result_line.line_end - trim_line);
+            continue;
+        }
+    }
+}
+
+// Turns word in text of line into the same word as it's written in line.
+void original_word(const ResultLine* result_line, const char** word, const char** word_end) {
+    if (!result_line->offsets)  return;
+    *word_end = result_line->line + result_line->offsets[*word_end - result_line->text];
+    *word = result_line->line + result_line->offsets[*word - result_line->text];
+}
+
+int __cdecl compare_lines(void const* aa, void const* bb) {
+    auto a = (ResultLine*)aa;
+    auto b = (ResultLine*)bb;
+
+    Note* note_a = a->note;
+    Note* note_b = b->note;
+
+    if (note_a && note_b == NULL)  return -1;
+    if (note_a == NULL && note_b)  return  1;
+
+    const char prefix[] = "[sound:core/";
+    int prefix_length = ARRAYSIZE(prefix) - 1;
+
+    if (note_a && note_b) {
+        int note_a_annotate_length = note_a->annotate_end - note_a->annotate;
+        int note_b_annotate_length = note_b->annotate_end - note_b->annotate;
 
         if (note_a_annotate_length >= prefix_length && 
             note_b_annotate_length >= prefix_length &&
@@ -578,21 +3221,94 @@ int __cdecl compare_lines(void const* aa, void const* bb) {
         }
         return sqlite3_strnicmp(note_a->annotate, note_b->annotate, max(note_a_annotate_length, note_b_annotate_length));
     }
-    return sqlite3_strnicmp(a->word, b->word, max(a->word_end - a->word, b->word_end - b->word));
+
+    // Lines without notes are sorted by their first words.
+    const char* word_a = a->text;
+    const char* word_a_end = a->text;
+    if (a->first_span < a->last_span) {
+        word_a += spans[a->first_span].offset;
+        word_a_end = word_a + spans[a->first_span].length;
+    }
+
+    const char* word_b = b->text;
+    const char* word_b_end = b->text;
+    if (b->first_span < b->last_span) {
+        word_b += spans[b->first_span].offset;
+        word_b_end = word_b + spans[b->first_span].length;
+    }
+
+    int result = compare_strings(word_a, word_a_end, word_b, word_b_end);
+    if (result != 0)  return result;
+
+    // Words that are the same after normalization, e.g. "ｶﾒﾗ" and "カメラ", are sorted by how they're written.
+    original_word(a, &word_a, &word_a_end);
+    original_word(b, &word_b, &word_b_end);
+    return compare_strings(word_a, word_a_end, word_b, word_b_end);
 }
 
 void sort_lines() {
     qsort(result_lines, result_lines_count, sizeof(ResultLine), compare_lines);
 }
 
+// Opens collection or its in-memory copy when snapshot_collection is enabled.
+sqlite3* open_collection() {
+    sqlite3* collection = NULL;
+    if (!snapshot_collection) {
+        verify(SQLITE_OK == sqlite3_open(collection_filename, &collection));
+        return collection;
+    }
+
+    LARGE_INTEGER tick_start = get_tick();
+
+    verify(SQLITE_OK == sqlite3_open_v2(collection_filename, &collection, SQLITE_OPEN_READONLY, NULL));
+    verify(SQLITE_OK == sqlite3_busy_timeout(collection, 5000));  // Wait for Anki to finish writing.
+
+    sqlite3* snapshot = NULL;
+    verify(SQLITE_OK == sqlite3_open(":memory:", &snapshot));
+
+    // Copy all pages in one step so read lock on collection is held only once and for as short as possible.
+    sqlite3_backup* backup = sqlite3_backup_init(snapshot, "main", collection, "main");
+    verify(backup);
+    verify(SQLITE_DONE == sqlite3_backup_step(backup, -1));
+    verify(SQLITE_OK == sqlite3_backup_finish(backup));
+
+    verify(SQLITE_OK == sqlite3_close(collection));
+    collection = NULL;
+
+    log_message("Copying collection to memory: %lf seconds\n", seconds_since(tick_start));
+    return snapshot;
+}
+
 void write_annotations() {
     {
-        sqlite3* anki = NULL;
-        verify(SQLITE_OK == sqlite3_open(collection_filename, &anki));
+        sqlite3* anki = open_collection();
+        register_sql_functions(anki);
 
+        LARGE_INTEGER tick_start = get_tick();
         collection_load_model(anki);
+        log_message("Loading model: %lf seconds\n", seconds_since(tick_start));
+
         build_note_cache(anki);
 
+        tick_start = get_tick();
+        resolve_result_lines();
+        log_message("Looking up words: %lf seconds\n", seconds_since(tick_start));
+        if (fuzzy_max_distance > 0)  log_message("Fuzzy lookup: %d words found\n", fuzzy_words_count);
+        if (bloom_blocks) {
+            // Rate is measured against keys that aren't in the deck, only they can be false positives.
+            int hits_count = bloom_checks_count - bloom_rejections_count - bloom_false_positives_count;
+            int misses_count = bloom_rejections_count + bloom_false_positives_count;
+            log_message("Bloom filter: %d checks, %d hits, %d misses, %d rejected, %d false positives (%.3lf%%)\n",
+                        bloom_checks_count, hits_count, misses_count, bloom_rejections_count, bloom_false_positives_count,
+                        misses_count ? 100.0 * bloom_false_positives_count / misses_count : 0.0);
+        }
+
+        if (lazy_annotation_loading) {
+            tick_start = get_tick();
+            load_note_annotations(anki);
+            log_message("Loading annotations: %lf seconds\n", seconds_since(tick_start));
+        }
+
         verify(SQLITE_OK == sqlite3_close(anki));
     }
 
@@ -0,0 +1,28 @@
+#include "shim.h"
+#define JSON_IMPLEMENTATION
+#include "/root/repo/src/json.h"
+#include <stdio.h>
+#include <string.h>
+int main(){
+  const char* docs[] = {
+    "{\"a\":1}", "{\"a\":1,}", "{,\"a\":1}", "{\"a\":[1,2,]}", "{\"a\":\"x\\u00e9\\ud83d\\ude00\"}",
+    "{\"a\": 9223372036854775807, \"b\": -9223372036854775808, \"c\": 1342697561419, \"d\": 1.5e3, \"e\": 0.1}",
+    "{\"a\": 01}", "{\"a\": +1}", "{\"a\": -}", "{\"a\": 1.}", "{\"a\": \"\\x\"}", "{\"a\": tru}", "{\"a\": null}",
+  };
+  for (auto d : docs) {
+    json_state s; bool ok = json_parse(&s, d, strlen(d));
+    printf("%-60s parse=%d %s\n", d, ok, ok?"":s.error_message);
+    if (ok) { json_dump(&s); printf("\n"); }
+    json_free(&s);
+  }
+  // cursor
+  const char* c1 = "{\"x\": {\"a\": [1, {\"b\": \"}\\\"]\"}], \"name\": \"M\"}, \"y\": {\"name\": \"N\", \"flds\": [{\"name\":\"Word\",\"ord\":0}]}}";
+  json_state s; json_cursor_begin(&s, c1, strlen(c1));
+  printf("enter %d\n", json_cursor_enter_object(&s));
+  const char* n; size_t nc;
+  while (json_cursor_next_member(&s, &n, &nc)) { printf("member %.*s\n", (int)nc, n); printf("skip %d\n", json_cursor_skip_value(&s)); }
+  printf("valid %d err %s\n", s.valid, s.error_message ? s.error_message : "");
+  // number scan
+  const char* nums[] = {"9007199254740993","18446744073709551616","4.9406564584124654e-324","1e400","-0","0.30000000000000004","123456789012345678901234567890","1.7976931348623157e308", "100000000000000000000000e-5", "0.000000000000000000001"};
+  for (auto x : nums) { json_number num; const char* e = json_scan_number(x, x+strlen(x), &num); printf("%s -> %.17g int=%d %lld end=%ld\n", x, num.number, num.is_integer, num.integer, e? (long)(e-x):-1); }
+}